@@ -0,0 +1,72 @@
+#include "control.hpp"
+
+#include <chrono>
+
+template<class T>
+static char* put_le(char* out, T v)
+{
+	for(usz i = 0; i < sizeof(T); i++)
+		*out++ = char(u64(v) >> (8 * i));
+	return out;
+}
+
+template<class T>
+static const char* get_le(const char* in, T& v)
+{
+	u64 x = 0;
+	for(usz i = 0; i < sizeof(T); i++)
+		x |= u64(u8(*in++)) << (8 * i);
+	v = T(x);
+	return in;
+}
+
+std::string Control::encode() const
+{
+	std::string out(SIZE, '\0');
+	char *p = &out[0];
+	p = put_le(p, speed);
+	p = put_le(p, steer);
+	p = put_le(p, seq);
+	put_le(p, time_us);
+	return out;
+}
+
+bool Control::decode(const std::string& payload)
+{
+	return decode(payload.data(), payload.size());
+}
+
+bool Control::decode(const char* data, usz size)
+{
+	if(size != SIZE)
+		return false;
+
+	const char *p = data;
+	p = get_le(p, speed);
+	p = get_le(p, steer);
+	p = get_le(p, seq);
+	get_le(p, time_us);
+	return true;
+}
+
+bool ControlFilter::accept(const Control& ctl)
+{
+	// outside of the sequence, like the will
+	if(!ctl.seq)
+		return true;
+
+	if(seq && i32(ctl.seq - seq) <= 0 && ctl.time_us < time_us + RESTART_US)
+	{
+		stale++;
+		return false;
+	}
+
+	seq = ctl.seq;
+	time_us = ctl.time_us;
+	return true;
+}
+
+u64 Control::now_us()
+{
+	return u64(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <string>
+
+/**
+ * @brief Speed and steering of one input change, published as one message on def::CONTROL_SUB
+ *
+ * Fixed little endian layout of Control::SIZE bytes, independent of the
+ * host byte order:
+ *  [ speed:i16 steer:i16 seq:u32 time_us:u64 ]
+ */
+struct Control
+{
+	static constexpr usz SIZE = 16;
+
+	i16 speed = 0;    ///< in def::MOTOR_SCALE
+	i16 steer = 0;    ///< in def::STEER_SCALE
+	u32 seq = 0;      ///< counts up per sender from 1, 0 for messages outside the sequence (e.g. the will)
+	u64 time_us = 0;  ///< sender time since epoch
+
+	/**
+	 * @return Payload to publish
+	 */
+	std::string encode() const;
+	/**
+	 * @brief Parse a received payload
+	 * @return false if the payload has the wrong size
+	 */
+	bool decode(const std::string& payload);
+	bool decode(const char* data, usz size);
+
+	/**
+	 * @return Current time in the unit of time_us
+	 */
+	static u64 now_us();
+};
+
+/**
+ * @brief Rejects control messages that aren't newer than the last accepted one
+ *
+ * Sequence numbers compare with wrap around, duplicates count as stale. A
+ * restarted sender counts from 1 again and is recognized by a sender time
+ * more than RESTART_US ahead of the last message.
+ */
+struct ControlFilter
+{
+	static constexpr u64 RESTART_US = 1000000;
+
+	/**
+	 * @return Whether ctl should be applied, it replaces the last message then
+	 */
+	bool accept(const Control& ctl);
+
+	/**
+	 * @return Sequence number of the last accepted message
+	 */
+	u32 last() const { return seq; }
+
+	u32 stale = 0; ///< rejected messages
+
+private:
+	u32 seq = 0;
+	u64 time_us = 0;
+};
@@ -25,4 +25,20 @@ constexpr auto STEER_DEF = (STEER_SCALE.min + STEER_SCALE.max) / 2;
 constexpr auto MOTOR_SUB = "sp/motor";
 constexpr Scale MOTOR_SCALE { -16, 16 };
 
+// speed and steer in one binary message, see Control
+constexpr auto CONTROL_SUB = "sp/control";
+
+// distance to the car ahead in mm, from whichever car measures it
+constexpr auto GAP_SUB = "sp/gap";
+
+// scanned barcode, each scan is an event that has to arrive
+constexpr auto BARCODE_SUB = "sp/barcode";
+
+// link statistics, one subtopic per daemon name
+constexpr auto TELEMETRY_SUB = "sp/telemetry/";
+
+// optional fast path of CONTROL_SUB without the broker, see ControlCast
+constexpr auto MULTICAST_GROUP = "239.255.31.37";
+constexpr unsigned short MULTICAST_PORT = 31338;
+
 }
@@ -1,13 +1,19 @@
 #include "echo.hpp"
 
+ip::udp::socket udp_socket(io_context& ioctx)
+{
+	ip::udp::socket socket(ioctx, ip::udp::v4());
+	socket.set_option(ip::udp::socket::reuse_address(true));
+	return socket;
+}
+
 Echo::Echo(io_context& ioctx, u16 port, std::string payload, std::chrono::steady_clock::duration interval)
-	: socket(ioctx, ip::udp::v4())
+	: socket(udp_socket(ioctx))
 	, ep(ip::address_v4::broadcast(), port)
 	, timer(ioctx)
 	, payload(std::move(payload))
 	, interval(interval)
 {
-	socket.set_option(ip::udp::socket::reuse_address(true));
 	socket.set_option(socket_base::broadcast(true));
 
 	broadcast({});
@@ -6,6 +6,11 @@
 #include <boost/asio/ip/udp.hpp>
 #include <boost/asio/steady_timer.hpp>
 
+/**
+ * @brief Open an IPv4 UDP socket whose port can be shared by several daemons on this host
+ */
+ip::udp::socket udp_socket(io_context& ioctx);
+
 struct Echo
 {
 	Echo(io_context& ioctx, u16 port, std::string payload, std::chrono::steady_clock::duration interval);
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <boost/asio/associated_allocator.hpp>
+
+#include <array>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * @brief Fixed storage for the pending operations of one owner
+ *
+ * Asio allocates every asynchronous operation together with its handler.
+ * Handlers wrapped with bind_memory() take one of the SLOTS blocks instead,
+ * only an operation larger than SLOT_SIZE or one beyond the free slots goes
+ * to the heap. Not thread safe, the owner must outlive its operations.
+ */
+struct HandlerMemory
+{
+	static constexpr usz SLOT_SIZE = 256;
+	static constexpr usz SLOTS = 8;
+
+	HandlerMemory() = default;
+	HandlerMemory(const HandlerMemory&) = delete;
+	HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+	void* allocate(usz size)
+	{
+		if(size <= SLOT_SIZE)
+			for(usz i = 0; i < SLOTS; i++)
+				if(!used[i])
+				{
+					used[i] = true;
+					return &slots[i];
+				}
+
+		fallbacks++;
+		return ::operator new(size);
+	}
+
+	void deallocate(void* p)
+	{
+		for(usz i = 0; i < SLOTS; i++)
+			if(p == &slots[i])
+			{
+				used[i] = false;
+				return;
+			}
+
+		::operator delete(p);
+	}
+
+	u32 fallbacks = 0; ///< operations that didn't fit and went to the heap
+
+private:
+	std::array<std::aligned_storage_t<SLOT_SIZE, alignof(std::max_align_t)>, SLOTS> slots;
+	std::array<bool, SLOTS> used {};
+};
+
+/**
+ * @brief Standard allocator handing out HandlerMemory
+ */
+template<class T>
+struct HandlerAllocator
+{
+	using value_type = T;
+
+	explicit HandlerAllocator(HandlerMemory& mem): mem(&mem) {}
+
+	template<class U>
+	HandlerAllocator(const HandlerAllocator<U>& other) noexcept: mem(other.mem) {}
+
+	T* allocate(usz n) { return static_cast<T*>(mem->allocate(sizeof(T) * n)); }
+	void deallocate(T* p, usz) { mem->deallocate(p); }
+
+	template<class U>
+	bool operator==(const HandlerAllocator<U>& other) const noexcept { return mem == other.mem; }
+	template<class U>
+	bool operator!=(const HandlerAllocator<U>& other) const noexcept { return mem != other.mem; }
+
+private:
+	template<class> friend struct HandlerAllocator;
+	HandlerMemory *mem;
+};
+
+/**
+ * @brief Handler whose operation is allocated from HandlerMemory, see bind_memory()
+ */
+template<class Handler>
+struct MemoryHandler
+{
+	using allocator_type = HandlerAllocator<Handler>;
+
+	allocator_type get_allocator() const noexcept { return allocator_type(*mem); }
+
+	template<class ...Args>
+	void operator()(Args&& ...args)
+	{
+		handler(std::forward<Args>(args)...);
+	}
+
+	HandlerMemory *mem;
+	Handler handler;
+};
+
+/**
+ * @brief Let asio allocate the operation of handler from mem
+ */
+template<class Handler>
+MemoryHandler<std::decay_t<Handler>> bind_memory(HandlerMemory& mem, Handler&& handler)
+{
+	return { &mem, std::forward<Handler>(handler) };
+}
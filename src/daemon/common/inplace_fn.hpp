@@ -0,0 +1,133 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template<class Sig, usz Size = 32>
+struct InplaceFn;
+
+/**
+ * @brief Function wrapper that stores the callable inside itself and never allocates
+ *
+ * Unlike std::function a callable that doesn't fit into Size bytes is a
+ * compile error instead of a heap allocation.
+ * @tparam R     Return type
+ * @tparam Args  Argument types
+ * @tparam Size  Inline storage in bytes
+ */
+template<class R, class ...Args, usz Size>
+struct InplaceFn<R(Args...), Size>
+{
+	InplaceFn() = default;
+	InplaceFn(std::nullptr_t) {}
+
+	template<class F, class = std::enable_if_t<!std::is_same<std::decay_t<F>, InplaceFn>::value>>
+	InplaceFn(F&& fn)
+	{
+		using Fn = std::decay_t<F>;
+		static_assert(sizeof(Fn) <= Size, "callable does not fit into InplaceFn, capture less or raise Size");
+		static_assert(alignof(Fn) <= alignof(Storage), "callable is over-aligned for InplaceFn");
+
+		new(&storage) Fn(std::forward<F>(fn));
+		ops = ops_of<Fn>();
+	}
+
+	InplaceFn(const InplaceFn& other)
+	{
+		if(other.ops)
+			other.ops->copy(&storage, &other.storage);
+		ops = other.ops;
+	}
+
+	InplaceFn(InplaceFn&& other) noexcept
+	{
+		if(other.ops)
+			other.ops->move(&storage, &other.storage);
+		ops = other.ops;
+		other.ops = nullptr; // moved-from storage is already destroyed
+	}
+
+	~InplaceFn()
+	{
+		reset();
+	}
+
+	InplaceFn& operator=(const InplaceFn& other)
+	{
+		if(this != &other)
+		{
+			reset();
+			if(other.ops)
+				other.ops->copy(&storage, &other.storage);
+			ops = other.ops;
+		}
+		return *this;
+	}
+
+	InplaceFn& operator=(InplaceFn&& other) noexcept
+	{
+		if(this != &other)
+		{
+			reset();
+			if(other.ops)
+				other.ops->move(&storage, &other.storage);
+			ops = other.ops;
+			other.ops = nullptr;
+		}
+		return *this;
+	}
+
+	InplaceFn& operator=(std::nullptr_t)
+	{
+		reset();
+		return *this;
+	}
+
+	R operator()(Args ...args) const
+	{
+		return ops->call(const_cast<Storage*>(&storage), std::forward<Args>(args)...);
+	}
+
+	explicit operator bool() const { return ops != nullptr; }
+
+	/**
+	 * @brief Destroy the stored callable
+	 */
+	void reset()
+	{
+		if(ops)
+			ops->destroy(&storage);
+		ops = nullptr;
+	}
+
+private:
+	using Storage = std::aligned_storage_t<Size, alignof(std::max_align_t)>;
+
+	struct Ops
+	{
+		R (*call)(void* fn, Args&& ...args);
+		void (*copy)(void* dst, const void* src);
+		void (*move)(void* dst, void* src);
+		void (*destroy)(void* fn);
+	};
+
+	template<class Fn>
+	static const Ops* ops_of()
+	{
+		static const Ops ops
+		{
+			[](void* fn, Args&& ...args) -> R { return (*static_cast<Fn*>(fn))(std::forward<Args>(args)...); },
+			[](void* dst, const void* src) { new(dst) Fn(*static_cast<const Fn*>(src)); },
+			[](void* dst, void* src) { new(dst) Fn(std::move(*static_cast<Fn*>(src))); static_cast<Fn*>(src)->~Fn(); },
+			[](void* fn) { static_cast<Fn*>(fn)->~Fn(); },
+		};
+		return &ops;
+	}
+
+	Storage storage;
+	const Ops* ops = nullptr;
+};
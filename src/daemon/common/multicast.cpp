@@ -0,0 +1,136 @@
+#include "multicast.hpp"
+
+#include "echo.hpp"
+
+#include <boost/asio/ip/multicast.hpp>
+
+// shared by all instances, spdlog refuses a second logger of the same name
+static loggr multicast_loggr()
+{
+	if(loggr logger = slog::get("multicast"))
+		return logger;
+	return new_loggr("multicast");
+}
+
+std::string ControlCast::Stats::json() const
+{
+	return fmt::format("{{\"received\":{},\"lost\":{},\"repeated\":{},\"late\":{},\"invalid\":{}}}",
+	                   received, lost, repeated, late, invalid);
+}
+
+ControlCast::ControlCast(io_context& ioctx, const std::string& group, u16 port, const std::string& iface, steady_timer::duration repeat)
+	: logger(multicast_loggr())
+	, socket(udp_socket(ioctx))
+	, ep(ip::make_address_v4(group), port)
+	, iface(iface.empty() ? ip::address_v4::any() : ip::make_address_v4(iface))
+	, timer(ioctx)
+	, interval(repeat)
+{
+	if(!ep.address().is_multicast())
+		throw std::runtime_error(group + " is no multicast address");
+
+	// stay on the local network, other daemons on this host get a copy
+	socket.set_option(ip::multicast::hops(1));
+	socket.set_option(ip::multicast::enable_loopback(true));
+	if(!this->iface.is_unspecified())
+		socket.set_option(ip::multicast::outbound_interface(this->iface));
+}
+
+void ControlCast::send(const Control& ctl)
+{
+	last = ctl.encode();
+
+	boost::system::error_code ec;
+	socket.send_to(buffer(last), ep, 0, ec);
+	if(ec)
+		logger->warn("sending #{} to {}:{} failed: {}", ctl.seq, ep.address().to_string(), ep.port(), ec.message());
+
+	if(interval == steady_timer::duration::zero())
+		return;
+	timer.expires_after(interval);
+	timer.async_wait([this](auto ec){ this->repeat(ec); });
+}
+
+void ControlCast::repeat(std::error_code ec)
+{
+	if(ec) return;
+
+	boost::system::error_code err;
+	socket.send_to(buffer(last), ep, 0, err);
+	timer.expires_after(interval);
+	timer.async_wait([this](auto ec){ this->repeat(ec); });
+}
+
+void ControlCast::listen(Callback callback)
+{
+	this->callback = std::move(callback);
+
+	socket.bind(ip::udp::endpoint(ip::address_v4::any(), ep.port()));
+	socket.set_option(ip::multicast::join_group(ep.address().to_v4(), iface));
+	logger->info("listening on {}:{}", ep.address().to_string(), ep.port());
+
+	receive();
+}
+
+void ControlCast::receive()
+{
+	socket.async_receive_from(buffer(rx), from, [this](boost::system::error_code ec, usz len)
+	{
+		if(ec == error::operation_aborted)
+			return;
+		if(ec)
+		{
+			logger->error("receive failed: {}", ec.message());
+			return;
+		}
+
+		Control ctl;
+		if(ctl.decode(rx.data(), len))
+		{
+			track(ctl);
+			callback(ctl);
+		}
+		else
+		{
+			counters.invalid++;
+			logger->debug("dropping {} bytes from {}", len, from.address().to_string());
+		}
+
+		receive();
+	});
+}
+
+void ControlCast::track(const Control& ctl)
+{
+	counters.received++;
+
+	// outside of the sequence, like a stop
+	if(!ctl.seq)
+		return;
+
+	const i32 ahead = i32(ctl.seq - seq);
+	const bool restart = ctl.time_us >= time_us + ControlFilter::RESTART_US;
+
+	// a restarted sender counts from 1 again
+	if(seq && !(ahead <= 0 && restart))
+	{
+		if(ahead == 0)
+		{
+			counters.repeated++;
+			return;
+		}
+		if(ahead < 0)
+		{
+			counters.late++;
+			return;
+		}
+		if(ahead > 1)
+		{
+			counters.lost += u32(ahead - 1);
+			logger->debug("lost {} before #{}", ahead - 1, ctl.seq);
+		}
+	}
+
+	seq = ctl.seq;
+	time_us = ctl.time_us;
+}
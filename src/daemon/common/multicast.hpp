@@ -0,0 +1,84 @@
+#pragma once
+
+#include "types.hpp"
+#include "asio.hpp"
+#include "control.hpp"
+#include "logger.hpp"
+
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <array>
+#include <functional>
+
+/**
+ * @brief Control messages over UDP multicast, straight from the controller to the cars
+ *
+ * Datagrams carry the Control payload of def::CONTROL_SUB unchanged, so a
+ * receiver that also subscribes via MQTT drops the slower copy with its
+ * ControlFilter. The sender repeats its last message while the input rests,
+ * which makes up for a lost datagram; receivers count gaps in the sequence
+ * numbers as lost.
+ */
+struct ControlCast
+{
+	/**
+	 * @brief Receive counters since the start
+	 */
+	struct Stats
+	{
+		u32 received = 0;  ///< datagrams with a valid payload
+		u32 lost = 0;      ///< sequence numbers skipped
+		u32 repeated = 0;  ///< repetitions of the last sequence number
+		u32 late = 0;      ///< sequence numbers behind the last one
+		u32 invalid = 0;   ///< datagrams of the wrong size
+
+		std::string json() const;
+	};
+
+	using Callback = std::function<void(const Control&)>;
+
+	/**
+	 * @param group   Multicast group address
+	 * @param port    UDP port of the group
+	 * @param iface   Address of the interface to use, e.g. 127.0.0.1 for loopback, empty for the default
+	 * @param repeat  Interval the last message is sent again, 0 to disable
+	 */
+	ControlCast(io_context& ioctx, const std::string& group, u16 port, const std::string& iface,
+	            steady_timer::duration repeat = std::chrono::milliseconds(100));
+
+	/**
+	 * @brief Send a message to the group
+	 */
+	void send(const Control& ctl);
+	/**
+	 * @brief Join the group and call callback with every received message
+	 */
+	void listen(Callback callback);
+
+	const Stats& stats() const { return counters; }
+
+private:
+	void receive();
+	void repeat(std::error_code ec);
+	/**
+	 * @brief Update the counters by the sequence number of a received message
+	 */
+	void track(const Control& ctl);
+
+	loggr logger;
+	ip::udp::socket socket;
+	ip::udp::endpoint ep;
+	ip::address_v4 iface;
+	steady_timer timer;
+	steady_timer::duration interval;
+
+	std::string last;  ///< payload sent last
+	Callback callback;
+	std::array<char, 64> rx;
+	ip::udp::endpoint from;
+
+	u32 seq = 0;       ///< last received sequence number
+	u64 time_us = 0;
+	Stats counters;
+};
@@ -4,8 +4,12 @@
 #include <mqtt/client.hpp>
 #include <mqtt/str_connect_return_code.hpp>
 
+#include <cmath>
+#include <cstdlib>
+
 MQTTClient::MQTTClient(io_context &ctx, const std::string &host, const std::string &port, const std::string &id)
-    : logger(new_loggr("net"))
+    : ctx(ctx)
+    , logger(new_loggr("net"))
     , client(mqtt::make_client(ctx, host, port))
 {
 	client->set_clean_session(true);
@@ -20,12 +24,8 @@ MQTTClient::MQTTClient(io_context &ctx, const std::string &host, const std::stri
 	                       const std::string& topic_name,
 	                       const std::string& contents)
 	{
-		auto itr = callbacks.find(topic_name);
-		if(itr == callbacks.end())
-			return true;
-
 		logger->trace("data: {}: {}", topic_name, contents);
-		itr->second.cb(contents);
+		callbacks.match(topic_name, [&](const SubCB& cb){ cb(contents); });
 
 		return true;
 	});
@@ -49,8 +49,8 @@ void MQTTClient::connect(std::function<void (bool, u8)> callback)
 		if(callback)
 			callback(sp, connack_return_code);
 
-		for(const auto& p: callbacks)
-			client->async_subscribe(p.first, p.second.qos);
+		for(const auto& p: filters)
+			client->async_subscribe(p.first, p.second);
 
 		return true;
 	});
@@ -61,21 +61,129 @@ void MQTTClient::connect(std::function<void (bool, u8)> callback)
 	});
 }
 
+void MQTTClient::set_profile(const std::string& filter, Profile profile)
+{
+	if(!profiles.insert(filter, profile))
+		logger->error("invalid topic filter {}", filter);
+}
+
+u8 MQTTClient::qos(const std::string& topic) const
+{
+	Profile p = Profile::EVENT;
+	profiles.match(topic, [&](Profile m){ p = std::min(p, m); });
+
+	switch(p)
+	{
+	case Profile::CONTROL: return mqtt::qos::at_most_once;
+	case Profile::EVENT:   return mqtt::qos::at_least_once;
+	}
+	return mqtt::qos::at_least_once;
+}
+
 void MQTTClient::subscribe(const std::string &topic, u8 qos, SubCB callback)
 {
-	callbacks.emplace(topic, Sub{qos, callback});
+	if(!callbacks.insert(topic, callback))
+	{
+		logger->error("invalid topic filter {}", topic);
+		return;
+	}
+
+	// the broker only needs to know each filter once, with the highest QoS asked for
+	auto it = filters.find(topic);
+	if(it != filters.end() && it->second >= qos)
+		return;
+	filters[topic] = qos;
+
 	if(client->connected())
 		client->async_subscribe(topic, qos);
 }
 
 void MQTTClient::subscribe(const std::string &topic, MQTTClient::SubCB callback)
 {
-	subscribe(topic, mqtt::qos::exactly_once, callback);
+	subscribe(topic, qos(topic), callback);
+}
+
+void MQTTClient::set_policy(const std::string& topic, Policy policy)
+{
+	auto it = throttles.find(topic);
+	if(it == throttles.end())
+		it = throttles.emplace(topic, Throttle{policy, steady_timer(ctx), {}, {}, {}, false, {}}).first;
+	else
+		it->second.policy = policy;
 }
 
 void MQTTClient::publish(const std::string &topic, const std::string &content)
 {
-	client->async_publish(topic, content);
+	auto it = throttles.find(topic);
+	if(it == throttles.end())
+	{
+		client->async_publish(topic, content, qos(topic));
+		return;
+	}
+
+	// the key stays put, so handlers may refer to it
+	const std::string &key = it->first;
+	Throttle &t = it->second;
+	const auto now = steady_timer::clock_type::now();
+	const auto slot = t.sent_at + t.policy.interval;
+
+	if(unchanged(t, content))
+	{
+		if(t.waiting || content != t.sent)
+			hold(key, t, content, std::max(slot, now + t.policy.settle));
+		return;
+	}
+
+	if(now < slot)
+		hold(key, t, content, slot);
+	else
+		send(key, t, content);
+}
+
+bool MQTTClient::unchanged(const Throttle& t, const std::string& content)
+{
+	if(t.policy.deadband <= 0 || t.sent_at == steady_timer::time_point())
+		return false;
+
+	char *end_a, *end_b;
+	const f64 a = std::strtod(content.c_str(), &end_a);
+	const f64 b = std::strtod(t.sent.c_str(), &end_b);
+	if(end_a == content.c_str() || *end_a || end_b == t.sent.c_str() || *end_b)
+		return content == t.sent;
+
+	return std::abs(a - b) < t.policy.deadband;
+}
+
+void MQTTClient::hold(const std::string& topic, Throttle& t, const std::string& content, steady_timer::time_point due)
+{
+	t.pending = content;
+	if(t.waiting && t.due <= due)
+		return;
+
+	t.waiting = true;
+	t.due = due;
+	t.timer.expires_at(due);
+	t.timer.async_wait([this, &topic, &t](auto ec)
+	{
+		if(ec) return;
+
+		t.waiting = false;
+		if(t.pending != t.sent)
+			send(topic, t, t.pending);
+	});
+}
+
+void MQTTClient::send(const std::string& topic, Throttle& t, const std::string& content)
+{
+	if(t.waiting)
+	{
+		t.waiting = false;
+		t.timer.cancel();
+	}
+
+	t.sent = content;
+	t.sent_at = steady_timer::clock_type::now();
+	client->async_publish(topic, content, qos(topic));
 }
 
 void MQTTClient::set_will(const std::string& topic, const std::string& content)
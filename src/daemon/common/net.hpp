@@ -3,9 +3,11 @@
 
 #include "asio.hpp"
 #include "logger.hpp"
+#include "topic_trie.hpp"
 #include "types.hpp"
 
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 #include <unordered_map>
 
@@ -38,26 +40,66 @@ struct MQTTClient
 	 */
 	void connect(std::function<void(bool clean, u8)> callback = {});
 
+	/**
+	 * @brief How messages of a topic are delivered
+	 */
+	enum class Profile : u8
+	{
+		CONTROL, ///< superseded within milliseconds: QoS 0, receivers drop stale ones by sequence number
+		EVENT,   ///< has to arrive: QoS 1, the default
+	};
+	/**
+	 * @brief Set the delivery profile of topics for publishing and subscribing
+	 *
+	 * If several filters match a topic, the cheapest profile applies.
+	 * Topics without a profile are EVENT.
+	 * @param filter   Topic filter, may contain wildcards
+	 */
+	void set_profile(const std::string& filter, Profile profile);
+	/**
+	 * @return QoS of the profile that applies to topic
+	 */
+	u8 qos(const std::string& topic) const;
+
 	/**
 	 * @brief Callback type for MQTT subscriptions
 	 */
 	using SubCB = std::function<void(const std::string& contents)>;
 	/**
 	 * @brief Subscribe to topic and react will a callback to publishments.
-	 * @param topic      Topic to subscribe to
+	 *
+	 * Every callback whose topic filter matches a message is called, so
+	 * overlapping subscriptions each see it once.
+	 * @param topic      Topic filter to subscribe to, may contain the wildcards '+' and '#'
 	 * @param qos        MQTT QoS parameter
 	 * @param callback   Will be called when the broker forwards a published message on the topic
 	 */
 	void subscribe(const std::string& topic, u8 qos, SubCB callback);
 	/**
 	 * @overload void subscribe(const std::string& topic, u8 qos, SubCB callback);
+	 * @note QoS follows the profile of topic.
 	 */
 	void subscribe(const std::string& topic, SubCB callback);
 
 	/**
-	 * @brief Publish a message on a topic
+	 * @brief Publish throttling of a topic, every limit is off by default
+	 */
+	struct Policy
+	{
+		steady_timer::duration interval {};  ///< least time between two messages, only the latest value waits for the next slot
+		f64 deadband = 0;                    ///< hold back numbers closer than this to the last sent one, other payloads if equal
+		steady_timer::duration settle = std::chrono::milliseconds(500); ///< a value held back by the deadband is sent after this long
+	};
+	/**
+	 * @brief Throttle publishes on a topic, the last value always goes out eventually
+	 * @param topic   Exact topic name
+	 */
+	void set_policy(const std::string& topic, Policy policy);
+
+	/**
+	 * @brief Publish a message on a topic with the QoS of its profile
 	 * @param topic     Topic to publish on
-	 * @param content   Payload of the message
+	 * @param content   Payload of the message, may be delayed or replaced by a newer one if the topic has a Policy
 	 */
 	void publish(const std::string& topic, const std::string& content);
 	/**
@@ -68,10 +110,37 @@ struct MQTTClient
 	void set_will(const std::string& topic, const std::string& content);
 
 private:
+	struct Throttle
+	{
+		Policy policy;
+		steady_timer timer;
+		std::string sent;                  ///< last published payload
+		steady_timer::time_point sent_at;
+		std::string pending;               ///< newest payload held back
+		bool waiting = false;              ///< timer runs for pending
+		steady_timer::time_point due;
+	};
+
+	/**
+	 * @return Whether content is within the deadband of the last sent payload
+	 */
+	static bool unchanged(const Throttle& t, const std::string& content);
+	/**
+	 * @brief Keep content as the latest value and send it at due at the latest
+	 */
+	void hold(const std::string& topic, Throttle& t, const std::string& content, steady_timer::time_point due);
+	/**
+	 * @brief Publish content right away and forget held back values
+	 */
+	void send(const std::string& topic, Throttle& t, const std::string& content);
+
+	io_context &ctx;
 	loggr logger;
 	std::shared_ptr<mqtt::client<mqtt::tcp_endpoint<ip::tcp::socket, io_context::strand>>> client;
 
-	struct Sub { u8 qos; SubCB cb; };
-	std::unordered_map<std::string, Sub> callbacks;
+	TopicTrie<SubCB> callbacks;
+	TopicTrie<Profile> profiles;
+	std::unordered_map<std::string, u8> filters; ///< QoS of every subscribed filter
+	std::unordered_map<std::string, Throttle> throttles;
 };
 
@@ -27,4 +27,8 @@ void CommonOpts::parse(argh::parser &opts, bool use_hostname)
 	opts({"-h", "--host"}, host) >> host;
 	opts({"-p", "--port"}, port) >> port;
 	echo_broadcast = opts["--echo"];
+	multicast.enabled = opts["--multicast"];
+	opts({"--multicast-group"}, multicast.group) >> multicast.group;
+	opts({"--multicast-port"}, multicast.port) >> multicast.port;
+	opts({"--multicast-if"}, multicast.iface) >> multicast.iface;
 }
@@ -3,6 +3,7 @@
 
 #include <argh.h>
 #include "def.hpp"
+#include "types.hpp"
 
 /**
  * @brief Contrainer for common command line options
@@ -12,6 +13,12 @@ struct CommonOpts
 {
 	std::string name, host = def::HOST, port = def::PORT;
 	bool echo_broadcast = false;
+	struct {
+		bool enabled = false;  ///< control messages via ControlCast too
+		std::string group = def::MULTICAST_GROUP;
+		u16 port = def::MULTICAST_PORT;
+		std::string iface;     ///< interface address, empty for the default one
+	} multicast;
 
 	/**
 	 * @brief Update options
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <array>
+#include <utility>
+
+/**
+ * @brief Fixed capacity FIFO queue without allocations
+ *
+ * Elements stay constructed in their slot, a popped slot is reused by
+ * assignment. Not thread safe.
+ * @tparam T  Element type, must be default constructible and move assignable
+ * @tparam N  Capacity
+ */
+template<class T, usz N>
+struct Ring
+{
+	/**
+	 * @brief Append an element
+	 * @return false if the ring is full, the element is left untouched
+	 */
+	bool push(T&& v)
+	{
+		if(full()) return false;
+		slots[(head + count) % N] = std::move(v);
+		count++;
+		return true;
+	}
+
+	/**
+	 * @brief Oldest element, ring must not be empty
+	 */
+	T& front() { return slots[head]; }
+
+	/**
+	 * @brief Remove the oldest element
+	 */
+	void pop()
+	{
+		slots[head] = T();
+		head = (head + 1) % N;
+		count--;
+	}
+
+	usz size() const { return count; }
+	bool empty() const { return count == 0; }
+	bool full() const { return count == N; }
+	static constexpr usz capacity() { return N; }
+
+private:
+	std::array<T, N> slots {};
+	usz head = 0;
+	usz count = 0;
+};
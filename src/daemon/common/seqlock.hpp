@@ -0,0 +1,51 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <atomic>
+#include <type_traits>
+
+/**
+ * @brief Single writer lock for small values read by other threads
+ *
+ * The writer never waits. Readers retry if a write happened while they copied the value.
+ * @tparam T  Trivially copyable value type
+ */
+template<class T>
+struct SeqLock
+{
+	static_assert(std::is_trivially_copyable<T>::value, "SeqLock needs a trivially copyable type");
+
+	/**
+	 * @brief Replace the value
+	 * @warning Only one thread may store.
+	 */
+	void store(const T& v)
+	{
+		const u32 s = seq.load(std::memory_order_relaxed);
+		seq.store(s + 1, std::memory_order_relaxed); // odd: write in progress
+		std::atomic_thread_fence(std::memory_order_release);
+		value = v;
+		seq.store(s + 2, std::memory_order_release);
+	}
+
+	/**
+	 * @brief Copy a consistent snapshot of the value
+	 */
+	T load() const
+	{
+		T v;
+		u32 begin, end;
+		do {
+			begin = seq.load(std::memory_order_acquire);
+			v = value;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			end = seq.load(std::memory_order_relaxed);
+		} while(begin != end || (begin & 1));
+		return v;
+	}
+
+private:
+	std::atomic<u32> seq {0};
+	T value {};
+};
@@ -0,0 +1,169 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief MQTT topic filters compiled into a tree of topic levels
+ *
+ * Filters may contain the wildcards '+' (exactly one level) and '#' (this
+ * and all following levels, must be last). Several handlers can share a
+ * filter. Matching a topic walks the levels in place and doesn't allocate;
+ * only insert() does. Topics starting with '$' aren't matched by wildcards
+ * on the first level, like brokers do. Not thread safe.
+ * @tparam Handler  Stored per filter, handed to the match callback
+ */
+template<class Handler>
+struct TopicTrie
+{
+	/**
+	 * @brief Add a handler for a topic filter
+	 * @return false if the filter is malformed, nothing is added then
+	 */
+	bool insert(const std::string& filter, Handler handler)
+	{
+		if(!valid(filter))
+			return false;
+
+		Node *n = &root;
+		const char *lvl = filter.data(), *end = lvl + filter.size();
+		for(;;)
+		{
+			const char *sep = std::find(lvl, end, '/');
+			const usz len = usz(sep - lvl);
+
+			if(len == 1 && *lvl == '#')
+			{
+				n->rest.push_back(std::move(handler));
+				return true;
+			}
+
+			n = &n->child(lvl, len);
+			if(sep == end)
+			{
+				n->exact.push_back(std::move(handler));
+				return true;
+			}
+			lvl = sep + 1;
+		}
+	}
+
+	/**
+	 * @brief Call fn with every handler whose filter matches topic
+	 * @note fn must not insert() into this trie.
+	 * @return Number of matching handlers
+	 */
+	template<class F>
+	usz match(const std::string& topic, F&& fn) const
+	{
+		const char *begin = topic.data(), *end = begin + topic.size();
+		const bool system = !topic.empty() && topic[0] == '$';
+		return match(root, begin, end, system, fn);
+	}
+
+	/**
+	 * @return Whether filter is a well formed MQTT topic filter
+	 */
+	static bool valid(const std::string& filter)
+	{
+		if(filter.empty())
+			return false;
+
+		for(usz i = 0; i < filter.size(); i++)
+		{
+			const char c = filter[i];
+			if(c != '+' && c != '#')
+				continue;
+
+			// a wildcard takes a whole level, '#' only the last one
+			const bool alone = (i == 0 || filter[i - 1] == '/') && (i + 1 == filter.size() || filter[i + 1] == '/');
+			if(!alone || (c == '#' && i + 1 != filter.size()))
+				return false;
+		}
+		return true;
+	}
+
+private:
+	struct Node;
+	struct Child
+	{
+		std::string name;
+		std::unique_ptr<Node> node;
+	};
+
+	struct Node
+	{
+		std::vector<Child> children;
+		std::unique_ptr<Node> plus;  ///< '+' level
+		std::vector<Handler> exact;  ///< filters ending here
+		std::vector<Handler> rest;   ///< filters ending with '#' after this level
+
+		/**
+		 * @return Child of a level, created if missing
+		 */
+		Node& child(const char* name, usz len)
+		{
+			if(len == 1 && *name == '+')
+			{
+				if(!plus)
+					plus = std::make_unique<Node>();
+				return *plus;
+			}
+
+			if(Node *n = find(name, len))
+				return *n;
+			children.push_back({std::string(name, len), std::make_unique<Node>()});
+			return *children.back().node;
+		}
+
+		const Node* find(const char* name, usz len) const
+		{
+			for(const Child& c: children)
+				if(c.name.size() == len && !std::memcmp(c.name.data(), name, len))
+					return c.node.get();
+			return nullptr;
+		}
+
+		Node* find(const char* name, usz len)
+		{
+			return const_cast<Node*>(static_cast<const Node*>(this)->find(name, len));
+		}
+	};
+
+	/**
+	 * @param lvl     Start of the remaining topic levels, nullptr after the last one
+	 * @param system  Skip wildcards on this level
+	 */
+	template<class F>
+	static usz match(const Node& n, const char* lvl, const char* end, bool system, F& fn)
+	{
+		usz found = 0;
+
+		// "a/#" also matches "a"
+		if(!system)
+			for(const Handler& h: n.rest) { fn(h); found++; }
+
+		if(!lvl)
+		{
+			for(const Handler& h: n.exact) { fn(h); found++; }
+			return found;
+		}
+
+		const char *sep = std::find(lvl, end, '/');
+		const char *next = sep == end ? nullptr : sep + 1;
+
+		if(const Node *c = n.find(lvl, usz(sep - lvl)))
+			found += match(*c, next, end, false, fn);
+		if(n.plus && !system)
+			found += match(*n.plus, next, end, false, fn);
+		return found;
+	}
+
+	Node root;
+};
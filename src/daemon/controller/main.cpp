@@ -1,7 +1,9 @@
 
 #include "asio.hpp"
+#include "control.hpp"
 #include "def.hpp"
 #include "echo.hpp"
+#include "multicast.hpp"
 #include "logger.hpp"
 #include "net.hpp"
 #include "opts.hpp"
@@ -25,6 +27,8 @@ struct {
 	CommonOpts common;
 	std::string dev_path = "/dev/input/js0";
 	def::Scale speed = def::MOTOR_SCALE;
+	std::string control = "binary"; // binary, text or both
+	u32 pub_rate_ms = 0; // least time between two control messages, 0 publishes every input change
 } conf;
 
 
@@ -45,11 +49,22 @@ int main(int argc, const char* argv[])
 	opts({"-D", "--device"}, conf.dev_path) >> conf.dev_path;
 	opts({"--spd-max"}, conf.speed.max) >> conf.speed.max;
 	opts({"--spd-min"}, conf.speed.min) >> conf.speed.min;
+	opts({"--control"}, conf.control) >> conf.control;
+	opts({"--pub-rate"}, conf.pub_rate_ms) >> conf.pub_rate_ms;
 
 	// let's go!
 	auto logger = new_loggr("app");
 	logger->info("sp-controller v0.1");
 
+	if(conf.control != "binary" && conf.control != "text" && conf.control != "both")
+	{
+		logger->error("unknown control mode {}, use binary, text or both", conf.control);
+		return 1;
+	}
+	// text topics for cortex versions without the binary one
+	const bool pub_binary = conf.control != "text";
+	const bool pub_text = conf.control != "binary";
+
 	io_context ioctx;
 
 	logger->info("initialising controller...");
@@ -57,8 +72,24 @@ int main(int argc, const char* argv[])
 
 	logger->info("connecting with id {} to {}:{}", conf.common.name, conf.common.host, conf.common.port);
 	MQTTClient cl (ioctx, conf.common.host, conf.common.port, conf.common.name);
-
-	cl.set_will(def::MOTOR_SUB, "0");
+	// no handshakes for inputs that are replaced right away
+	for(auto topic: {def::CONTROL_SUB, def::MOTOR_SUB, def::STEER_SUB})
+		cl.set_profile(topic, MQTTClient::Profile::CONTROL);
+
+	// only one will is possible, stop via the binary topic if it's published
+	if(pub_binary)
+		cl.set_will(def::CONTROL_SUB, Control{}.encode());
+	else
+		cl.set_will(def::MOTOR_SUB, "0");
+
+	// the latest input wins, the final one is always sent
+	if(conf.pub_rate_ms)
+	{
+		MQTTClient::Policy rate;
+		rate.interval = std::chrono::milliseconds(conf.pub_rate_ms);
+		for(auto topic: {def::CONTROL_SUB, def::MOTOR_SUB, def::STEER_SUB})
+			cl.set_policy(topic, rate);
+	}
 	cl.connect();
 
 	// helper for publishing MQTT messages
@@ -73,9 +104,42 @@ int main(int argc, const char* argv[])
 	auto motor = [&](i32 v){ on_change(v, [&](auto p, auto v){ forward(def::MOTOR_SUB, p, v); }); };
 	auto steer = [&](i32 v){ on_change(v, [&](auto p, auto v){ forward(def::STEER_SUB, p, v); }); };
 
+	// same messages straight to the cars, MQTT stays as fallback
+	std::unique_ptr<ControlCast> cast;
+	if(conf.common.multicast.enabled)
+	{
+		const auto &mc = conf.common.multicast;
+		logger->info("sending control to {}:{}", mc.group, mc.port);
+		cast = std::make_unique<ControlCast>(ioctx, mc.group, mc.port, mc.iface);
+	}
+
+	// publish both values of an input change, in one message if possible
+	Control ctl;
+	auto drive = [&](i32 speed, i32 deg)
+	{
+		if(pub_text)
+		{
+			motor(speed);
+			steer(deg);
+		}
+
+		if((pub_binary || cast) && (speed != ctl.speed || deg != ctl.steer))
+		{
+			ctl.speed = i16(speed);
+			ctl.steer = i16(deg);
+			ctl.seq++;
+			ctl.time_us = Control::now_us();
+			logger->debug("PUB: {}: #{} {:3} {:3}", def::CONTROL_SUB, ctl.seq, ctl.speed, ctl.steer);
+			if(pub_binary)
+				cl.publish(def::CONTROL_SUB, ctl.encode());
+			if(cast)
+				cast->send(ctl);
+		}
+	};
+
 	// stop when controller went missing
 	bool err = false;
-	ctrl.on_err = [&](auto){ err = true, motor(0), steer(0); };
+	ctrl.on_err = [&](auto){ err = true, drive(0, 0); };
 
 	// handle gamepad input events
 	ctrl.on_axis = [&](u32, Controller::Axis num, i16 val)
@@ -108,7 +172,6 @@ int main(int argc, const char* argv[])
 		                 conf.speed.min, conf.speed.max);
 
 		logger->trace("speed: {:6} -> {:4}", speed_input, speed_mapped);
-		motor(speed_mapped);
 
 		i32 steer_input = input_state[Controller::LS_H];
 		i32 steer_mapped =
@@ -117,7 +180,7 @@ int main(int argc, const char* argv[])
 		                      def::STEER_SCALE.min, def::STEER_SCALE.max);
 
 		logger->trace("steer: {:6} -> {:4}", steer_input, steer_mapped);
-		steer(steer_mapped);
+		drive(speed_mapped, steer_mapped);
 	};
 
 	// handle keyboard events
@@ -141,8 +204,8 @@ int main(int argc, const char* argv[])
 		logger->trace("on_key: {:2} - {:6}", i->first, i->second);
 
 		// simple binary input: key down -> full speed
-		motor(map_dual(input_state[KEY_W] - input_state[KEY_S], -1, 1, conf.speed.min, conf.speed.max));
-		steer(def::STEER_SCALE.max * (input_state[KEY_D] - input_state[KEY_A]));
+		drive(map_dual(input_state[KEY_W] - input_state[KEY_S], -1, 1, conf.speed.min, conf.speed.max),
+		      def::STEER_SCALE.max * (input_state[KEY_D] - input_state[KEY_A]));
 	};
 
 	// in case the daemon needs to be found on a convoluted network
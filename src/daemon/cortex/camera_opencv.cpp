@@ -2,36 +2,86 @@
 
 #include <zbar.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 
 
 using namespace cv;
 using namespace zbar;
 
-void SyncCamera::start_sync_camera(std::atomic<int> *return_value) {
+/**
+ * @brief Frame scale of a sweep step, evenly spaced between 100% and 20%
+ */
+static inline double sweep_scale(int i, int iterations) {
+	return 1.0 - (0.8/iterations * i);
+}
+
+/**
+ * @brief Rectangle with position and size multiplied by scale
+ */
+static inline Rect2d scale_rect(const Rect2d &r, double scale) {
+	return Rect2d(r.x * scale, r.y * scale, r.width * scale, r.height * scale);
+}
+
+void SyncCamera::start_sync_camera() {
 	double matchvalue = 0.0;
-	flush_frames(1);
+	bool lost = false;
+	start_capture();
 	for(;;) {
 		matchvalue = 0.0;
-		while(matchvalue == 0)
+		//a short loss leaves the pattern close to where it was, look there first
+		//-1 means no frame arrived, that doesn't use up an attempt
+		for(int attempt = 0; lost && matchvalue <= 0 && attempt < REACQUIRE_ATTEMPTS; )
+		{
+			matchvalue = reacquire(CV_TM_SQDIFF_NORMED, attempt);
+			if(matchvalue == 0) attempt++;
+		}
+		while(matchvalue <= 0)
 		{
 			matchvalue = pattern_matching_scaled(CV_TM_SQDIFF_NORMED); //look for pattern
-			if (matchvalue > 0) {
-				return_value->store(0);
-				initialize_tracker("KCF");
-				break; //pattern found, break loop
-			}
-			flush_frames(1); //if no pattern was detected, keep camera busy for 1 second
 		}
+		initialize_tracker("KCF");
 
-
-
-		while (return_value->load() >= 0)
+		for(int x = 0; x >= 0; )
 		{
-			return_value->store(track_next());
+			x = track_next();
+			publish(x, x >= 0 ? matchvalue : 0.0);
 		}
+		//never go on with the tracker that lost the pattern
+		tracker.release();
+		tracker_is_initialized = 0;
+		lost = true;
 	}
 }
 
+void SyncCamera::publish(i32 x, f32 confidence) {
+	CamResult r;
+	r.x = x;
+	r.confidence = confidence;
+	r.time = tracking_frame.time;
+	r.seq = ++result_seq;
+	r.frame = tracking_frame.seq;
+	r.frame_ms = track_cost_ms;
+	r.scale = track_scale;
+	result.store(r);
+	if(result_cb) result_cb();
+}
+
+void SyncCamera::on_result(std::function<void()> callback) {
+	result_cb = callback;
+}
+
+CamResult SyncCamera::get_result() const {
+	return result.load();
+}
+
 /*
 void *start_sync_camera(void *thread_data) {
 	struct camera_thread_data *local_data;
@@ -58,56 +108,137 @@ void *start_sync_camera(void *thread_data) {
 */
 
 void SyncCamera::continuous_scan_barcode(std::atomic<int> *return_barcode, int retries, int show_rectangle) {
-	long* barcode = new long(0);
-	//keep scanning until we find a barcode
-	if (retries!=0) {
-		for (int i = 0;i<retries;i++) {
-			*barcode=scan_barcode(show_rectangle);
-			if(*barcode != 0) {
-				*return_barcode = *barcode;
-				return;
-				//pthread_exit((void**)barcode); //found barcode or encountered an error, exiting
-			}
-		}
-	}
-	else for (;;) { // infinite scan
-		*barcode=scan_barcode(show_rectangle);
-		if(*barcode != 0) {
-			*return_barcode=*barcode;
+	//keep scanning until we find a barcode, retries 0 is infinite
+	for (int i = 0; retries == 0 || i < retries; i++) {
+		long barcode = scan_barcode(show_rectangle);
+		if(barcode != 0) {
+			*return_barcode = barcode; //found barcode or encountered an error
 			return;
-			//pthread_exit((void**)barcode); //found barcode or encountered an error, exiting
 		}
 	}
-	return;
-	 //pthread_exit((void**)barcode); // exit with zero
 }
 
+void SyncCamera::start_barcode_scan(std::function<void(long)> callback) {
+	if(scanning.exchange(true)) return;
+	start_capture();
+	barcode_thread = std::thread([this, callback]{
+		long last = 0;
+		while(scanning) {
+			if(!next_frame(barcode_frame)) continue; // no frame within a second, check for stop
+			long barcode = scan_barcode(barcode_frame.image);
+			// a barcode stays in view for several frames, report it once
+			if(barcode > 0 && barcode != last)
+				callback(barcode);
+			if(barcode >= 0)
+				last = barcode;
+		}
+	});
+}
+
+void SyncCamera::stop_barcode_scan() {
+	scanning = false;
+	if(barcode_thread.joinable())
+		barcode_thread.join();
+}
 
 SyncCamera::SyncCamera(const std::string &cam_path, const std::string &pattern_path)
-    : cap(cam_path)
-    , input_template(cv::imread(pattern_path, cv::IMREAD_COLOR))
-    , cam_fps(cap.get(CAP_PROP_FPS))
 {
-	if(!cap.isOpened())
-	{
-		access(cam_path.c_str(), R_OK);
-		throw std::system_error(std::error_code(errno, std::system_category()));
-	}
+	// video devices are streamed directly, anything else is a recording
+	if(cam_path.compare(0, 10, "/dev/video") == 0)
+		source.reset(new V4L2Source(cam_path));
+	else
+		source.reset(new FileSource(cam_path));
+
+	set_pattern(pattern_path);
+
+	scanner.reset(new ImageScanner);
+	if(scanner->set_config(ZBAR_NONE, ZBAR_CFG_ENABLE, 1) != 0)
+		throw std::runtime_error("failed to configure barcode scanner");
 }
 
 SyncCamera::~SyncCamera() {
-	cap.release();
+	stop_barcode_scan();
+	stop_capture();
+}
+
+void SyncCamera::start_capture() {
+	if(capturing.exchange(true)) return;
+	capture_thread = std::thread([this]{ capture(); });
+}
+
+void SyncCamera::stop_capture() {
+	capturing = false;
+	if(capture_thread.joinable())
+		capture_thread.join();
+}
+
+void SyncCamera::capture() {
+	Mat view;
+	FrameRing::clock::time_point time;
+	while(capturing) {
+		if(!source->acquire(view, time)) { // device gone or end of recording, don't spin
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			continue;
+		}
+		Mat *image = frames.claim();
+		if(image) { // otherwise every slot is being read, drop this frame
+			convert_frame(view, *image); // once per frame, for every consumer
+			frames.commit(time);
+		}
+		source->release();
+	}
+}
+
+bool SyncCamera::next_frame(FrameRing::Frame &frame) {
+	return frames.wait(frame, frame.seq, std::chrono::seconds(1));
 }
 
 void SyncCamera::set_resolution(u32 width, u32 height) {
-	cap.set(CAP_PROP_FOURCC, CAP_OPENCV_MJPEG);
-	cap.set(CAP_PROP_FRAME_WIDTH,width);
-	cap.set(CAP_PROP_FRAME_HEIGHT,height);
-	cam_fps = cap.get(CAP_PROP_FPS); //read back fps
+	source->set_resolution(width, height);
 }
 
 void SyncCamera::set_pattern(String pattern) {
-	input_template = imread(pattern,IMREAD_COLOR);
+	pattern_source = imread(pattern,IMREAD_COLOR);
+	prepare_pattern();
+}
+
+void SyncCamera::set_color_mode(ColorMode mode) {
+	color_mode = mode;
+	prepare_pattern();
+}
+
+void SyncCamera::prepare_pattern() {
+	input_template.release();
+	pattern_coarse.release();
+	if(pattern_source.empty()) return;
+
+	// everything the searches need from the template, so they don't redo it per frame
+	convert_frame(pattern_source, input_template);
+
+	// coarse pyramid level: the template must stay big enough to carry its features
+	pattern_coarse_scale = PYRAMID_COARSE;
+	const int templ_min = std::min(input_template.cols, input_template.rows);
+	if (templ_min * pattern_coarse_scale < PYRAMID_TEMPLATE_MIN)
+		pattern_coarse_scale = std::min(1.0, double(PYRAMID_TEMPLATE_MIN) / templ_min);
+	resize(input_template,pattern_coarse,Size(),pattern_coarse_scale,pattern_coarse_scale,INTER_AREA);
+}
+
+void SyncCamera::convert_frame(const Mat &in, Mat &out) const {
+	const bool gray = color_mode == ColorMode::Gray;
+	switch(in.channels()) {
+	case 1: // GREY camera or the Y plane
+		if(gray) in.copyTo(out);
+		else cvtColor(in,out,COLOR_GRAY2BGR);
+		break;
+	case 2: // YUYV camera
+		if(gray) extractChannel(in,out,0);
+		else cvtColor(in,out,COLOR_YUV2BGR_YUYV);
+		break;
+	default: // BGR from a recording
+		if(gray) cvtColor(in,out,COLOR_BGR2GRAY);
+		else in.copyTo(out);
+		break;
+	}
 }
 
 void SyncCamera::set_matchval(double value) {
@@ -115,38 +246,55 @@ void SyncCamera::set_matchval(double value) {
 }
 
 
+void SyncCamera::set_barcode_roi(const Rect &roi) {
+	barcode_roi = roi;
+}
+
 long SyncCamera::scan_barcode(int show_rectangle) {
-	if(!cap.isOpened()) { return -1; }
-	Mat image;
-	cap >> image;
-	Mat grayscale;
-	cvtColor(image,grayscale,CV_YUV2RGB); // convert to RGB
-	cvtColor(grayscale,grayscale,CV_RGBA2GRAY); //convert to grayscale
-	//cvtColor(framein,framein,CV_YUV2GRAY_420);
+	if(!source) { return -1; }
+	if(!next_frame(barcode_frame)) { return -1; }
+	return scan_barcode(barcode_frame.image, show_rectangle);
+}
+
+long SyncCamera::scan_barcode(Mat &image, int show_rectangle) {
+	Rect roi = barcode_roi & Rect(0, 0, image.cols, image.rows);
+	if(roi.area() == 0)
+		roi = Rect(0, 0, image.cols, image.rows);
+
+	// zbar wants a packed 8 bit intensity image, convert or copy in one pass only if needed
+	Mat grayscale = image(roi);
+	if(grayscale.channels() != 1) {
+		cvtColor(grayscale, barcode_gray, CV_BGR2GRAY);
+		grayscale = barcode_gray;
+	} else if(!grayscale.isContinuous()) {
+		grayscale.copyTo(barcode_gray);
+		grayscale = barcode_gray;
+	}
+
 	long barcode = 0;
-	ImageScanner barscan;
-	if(barscan.set_config(ZBAR_NONE, ZBAR_CFG_ENABLE, 1)!=0) { return -1; }
-	// convert Matrix to useable image;
 	int width = grayscale.cols;
 	int height = grayscale.rows;
-	uchar *rawframe = (uchar *)grayscale.data;
-	Image image_gray(width, height, "Y800", rawframe, width * height);
+	Image image_gray(width, height, "Y800", grayscale.data, width * height);
 
 	//scan for barcode, returns 0 on no barcode, or value >0 when a barcode was found
-	int i = barscan.scan(image_gray);
+	int i = scanner->scan(image_gray);
 	// exit on no barcode
 	if (i==0) return 0;
+	if (i<0) return -1;
 	//get barcode from image
 	for(auto symbol = image_gray.symbol_begin();symbol != image_gray.symbol_end();++symbol) {
-		//cout << "Detected Type: " << symbol->get_type_name() << "    Barcode: " << symbol->get_data() << "                  \r";
-		// ONLY RETURNS LAST BARCODE DETECTED, IF MULTIPLE!
-		barcode = std::stol(symbol->get_data());
+		// ONLY RETURNS LAST NUMERIC BARCODE DETECTED, IF MULTIPLE!
+		try {
+			barcode = std::stol(symbol->get_data());
+		} catch(std::logic_error&) {
+			continue; // not a track code
+		}
 		if(show_rectangle) {
 			std::vector<Point> vp;
 			int n = symbol->get_location_size();
 			// mark barcode rectangle
 			for(int i=0;i<n;i++)  {
-				vp.push_back(Point(symbol->get_location_x(i),symbol->get_location_y(i)));
+				vp.push_back(Point(roi.x + symbol->get_location_x(i), roi.y + symbol->get_location_y(i)));
 			}
 			RotatedRect r = minAreaRect(vp);
 			Point2f pts[4];
@@ -162,57 +310,194 @@ long SyncCamera::scan_barcode(int show_rectangle) {
 }
 
 double SyncCamera::pattern_matching_scaled(int match_method, int iterations) {
-	Mat result, image_resized;
-	if (!cap.isOpened()) { return -1; }
-	double matchVal_best = 0.0, scale_best = 0.0;
-	Point matchLoc_best;
-	cap >> tracking_image;
-	image_resized = tracking_image.clone(); //copy the input image
+	if (!source) { return -1; }
+	if (!next_frame(tracking_frame)) { return -1; }
+	return pattern_matching_scaled(tracking_frame.image, match_method, iterations);
+}
+
+double SyncCamera::pattern_matching_scaled(Mat &image, int match_method, int iterations) {
+	Match best;
+	if (search_mode == SearchMode::Pyramid)
+		best = search_pyramid(image, match_method, iterations);
+	else
+		best = search_exhaustive(image, match_method, iterations);
+
+	if (best.scale == 0) { return 0; } //nothing found
+	//save initial rectangle for motion tracking later
+	tracking_rectangle = best.rect;
+	rectangle(image,tracking_rectangle,Scalar(0,0,255), 2, 8, 0 );  //draw rectangle into the original image
+	return best.value;
+}
+
+SyncCamera::Match SyncCamera::match_scale(const Mat &image, int match_method, double scale, Rect roi) const {
+	Match match;
+	Mat image_resized, result;
+	resize(image(roi),image_resized,Size(),scale,scale,INTER_AREA); // resize region to current scale
+	int result_rows = image_resized.rows - input_template.rows + 1;  //calculate max. size
+	int result_cols = image_resized.cols - input_template.cols + 1;
+	if ( result_rows < 1 || result_cols < 1 ) return match; // template is bigger than the image
+	//create result & match template
+	result.create(result_rows,result_cols,CV_32FC1);
+	matchTemplate(image_resized,input_template,result,match_method);
+	// extract values with minmaxloc
+	double minVal, maxVal;
+	Point minLoc, maxLoc, matchLoc;
+	minMaxLoc( result, &minVal, &maxVal, &minLoc, &maxLoc, Mat());
+	if(match_method == CV_TM_SQDIFF || match_method == CV_TM_SQDIFF_NORMED)  // these methods have reverse logic, smaller number = better match
+	{
+		matchLoc = minLoc;
+		match.value = (1-minVal);
+	}
+	else
+	{
+		matchLoc = maxLoc;
+		match.value = maxVal;
+	}
+	//carefully undo the scaling into full frame coordinates
+	match.scale = scale;
+	match.rect.x = roi.x + matchLoc.x/scale;
+	match.rect.y = roi.y + matchLoc.y/scale;
+	match.rect.width = input_template.cols/scale;
+	match.rect.height = input_template.rows/scale;
+	return match;
+}
+
+SyncCamera::Match SyncCamera::search_exhaustive(const Mat &image, int match_method, int iterations) const {
+	Match best;
+	const Rect full(0, 0, image.cols, image.rows);
+	if (match_threads > 1) {
+		// every scale writes only its own slot, the reduction below runs in scale order
+		std::vector<Match> matches(iterations);
+		const int stripes = std::min(match_threads, iterations);
+		parallel_for_(Range(0, stripes), [&](const Range &range) {
+			// interleave the scales, big ones are the most expensive
+			for (int s=range.start;s<range.end;s++)
+				for (int i=s;i<iterations;i+=stripes)
+					matches[i] = match_scale(image, match_method, sweep_scale(i, iterations), full);
+		}, stripes);
+
+		for (const Match &match : matches) {
+			if (match.scale == 0) break; // same early exit as the serial loop
+			if(match.value>this->matchval && match.value>best.value)
+				best = match;
+		}
+		return best;
+	}
+
 	for (int i=0;i<iterations;i++) {  // loop over input image scales, divide into even chunks between 100% and 20%
-		double curr_scale = 1.0 - (0.8/iterations * i);
-		resize(tracking_image,image_resized,Size(),curr_scale,curr_scale,INTER_AREA); // resize picture to current scale
-		int result_rows = image_resized.rows - input_template.rows + 1;  //calculate max. size
-		int result_cols = image_resized.cols - input_template.cols + 1;
-		if ( result_rows < 1 || result_cols < 1 ) break; // exit loop if template is bigger than the image
-		//create result & match template
-		result.create(result_rows,result_cols,CV_32FC1);
-		matchTemplate(image_resized,input_template,result,match_method);
-		// extract values with minmaxloc
-		double minVal, maxVal, matchVal;
-		Point minLoc, maxLoc, matchLoc;
+		Match match = match_scale(image, match_method, sweep_scale(i, iterations), full);
+		if (match.scale == 0) break; // exit loop if template is bigger than the image
+		if(match.value>this->matchval && match.value>best.value) { // new best match found, saving
+			best = match;
+		} // else discard all
+	}
+	return best;
+}
+
+SyncCamera::Match SyncCamera::search_pyramid(const Mat &image, int match_method, int iterations) const {
+	// coarse pass: the same scale sweep on a shrunken frame with the shrunken template
+	const double coarse = pattern_coarse_scale;
+	const Mat &templ_small = pattern_coarse;
+
+	Mat image_small, image_resized, result;
+	resize(image,image_small,Size(),coarse,coarse,INTER_AREA);
+
+	std::vector<std::pair<int, Match>> candidates; // scale index and match in full frame coordinates
+	for (int i=0;i<iterations;i++) {
+		double curr_scale = sweep_scale(i, iterations);
+		resize(image_small,image_resized,Size(),curr_scale,curr_scale,INTER_AREA);
+		if (image_resized.rows < templ_small.rows || image_resized.cols < templ_small.cols) break;
+		matchTemplate(image_resized,templ_small,result,match_method);
+		double minVal, maxVal;
+		Point minLoc, maxLoc;
 		minMaxLoc( result, &minVal, &maxVal, &minLoc, &maxLoc, Mat());
-		if(match_method == CV_TM_SQDIFF || match_method == CV_TM_SQDIFF_NORMED)  // these methods have reverse logic, smaller number = better match
-		{
-			matchLoc = minLoc;
-			matchVal = (1-minVal);
-		}
-		else
-		{
-			matchLoc = maxLoc;
-			matchVal = maxVal;
+		bool sqdiff = match_method == CV_TM_SQDIFF || match_method == CV_TM_SQDIFF_NORMED;
+		Point loc = sqdiff ? minLoc : maxLoc;
+
+		Match match;
+		match.value = sqdiff ? 1-minVal : maxVal;
+		match.scale = curr_scale;
+		match.rect = Rect2d(loc.x/(coarse*curr_scale), loc.y/(coarse*curr_scale),
+		                    input_template.cols/curr_scale, input_template.rows/curr_scale);
+		candidates.emplace_back(i, match);
+	}
+
+	// keep only the best few candidates for refinement
+	auto by_value = [](const std::pair<int, Match> &a, const std::pair<int, Match> &b) { return a.second.value > b.second.value; };
+	if (candidates.size() > PYRAMID_CANDIDATES) {
+		std::partial_sort(candidates.begin(), candidates.begin() + PYRAMID_CANDIDATES, candidates.end(), by_value);
+		candidates.resize(PYRAMID_CANDIDATES);
+	}
+
+	// fine pass: full resolution, but only around the candidates and at neighbouring scales
+	Match best;
+	const Rect full(0, 0, image.cols, image.rows);
+	for (const auto &candidate : candidates) {
+		const Rect2d &rect = candidate.second.rect;
+		// one coarse pixel of uncertainty plus the size difference to the neighbour scales
+		double margin = 2.0 / (coarse * candidate.second.scale) + rect.width * 0.8 / iterations;
+		Rect roi(Point(int(rect.x - margin), int(rect.y - margin)),
+		         Point(int(rect.x + rect.width + margin) + 1, int(rect.y + rect.height + margin) + 1));
+		roi &= full;
+
+		for (int i = std::max(0, candidate.first - 1); i <= std::min(iterations - 1, candidate.first + 1); i++) {
+			Match match = match_scale(image, match_method, sweep_scale(i, iterations), roi);
+			if(match.scale != 0 && match.value>this->matchval && match.value>best.value)
+				best = match;
 		}
-		if(matchVal>this->matchval && matchVal>matchVal_best) { // new best match found, saving
-			matchVal_best = matchVal;
-			matchLoc_best = matchLoc;
-			scale_best = curr_scale;
-		} // else discard all
 	}
-	//if(matchVal_best == 0) { return 0; }  //nothing found
-	//carefully undo the scaling and save initial rectangle for motion tracking later
-	tracking_rectangle.x = matchLoc_best.x/scale_best;
-	tracking_rectangle.y = matchLoc_best.y/scale_best;
-	tracking_rectangle.width = input_template.cols/scale_best;
-	tracking_rectangle.height = input_template.rows/scale_best;
-	if(scale_best!=0) {
-		rectangle(tracking_image,tracking_rectangle,Scalar(0,0,255), 2, 8, 0 );  //draw rectangle into the original image
+	return best;
+}
+
+double SyncCamera::reacquire(int match_method, int attempt, int iterations) {
+	if (!source) { return -1; }
+	if (tracking_rectangle.area() <= 0) { return 0; }
+	if (!next_frame(tracking_frame)) { return -1; }
+	return reacquire(tracking_frame.image, match_method, attempt, iterations);
+}
+
+double SyncCamera::reacquire(const Mat &image, int match_method, int attempt, int iterations) {
+	if (tracking_rectangle.area() <= 0) { return 0; }
+
+	// scale step closest to the size the pattern had when it was lost
+	const double scale_last = input_template.cols / tracking_rectangle.width;
+	const int step_last = cvRound((1.0 - scale_last) * iterations / 0.8);
+
+	// window grows by half the pattern size on each side with every attempt
+	const double grow_x = tracking_rectangle.width / 2 * (attempt + 1);
+	const double grow_y = tracking_rectangle.height / 2 * (attempt + 1);
+	Rect roi(Point(int(tracking_rectangle.x - grow_x), int(tracking_rectangle.y - grow_y)),
+	         Point(int(tracking_rectangle.x + tracking_rectangle.width + grow_x) + 1,
+	               int(tracking_rectangle.y + tracking_rectangle.height + grow_y) + 1));
+	roi &= Rect(0, 0, image.cols, image.rows);
+	if (roi.area() <= 0) { return 0; }
+
+	Match best;
+	for (int i = std::max(0, step_last - REACQUIRE_SCALES); i <= std::min(iterations - 1, step_last + REACQUIRE_SCALES); i++) {
+		Match match = match_scale(image, match_method, sweep_scale(i, iterations), roi);
+		if(match.scale != 0 && match.value>this->matchval && match.value>best.value)
+			best = match;
 	}
-	return matchVal_best;
+
+	if (best.scale == 0) { return 0; }
+	tracking_rectangle = best.rect;
+	return best.value;
+}
+
+void SyncCamera::set_search_mode(SearchMode mode) {
+	search_mode = mode;
+}
+
+void SyncCamera::set_match_threads(int threads) {
+	match_threads = threads > 0 ? threads : getNumberOfCPUs();
 }
 
 int SyncCamera::pattern_matching(int match_method) {
 	Mat result, image;
-	if (!cap.isOpened()) { return -1; }
-	cap >> image;
+	if (!source) { return -1; }
+	FrameRing::Frame frame;
+	if (!next_frame(frame)) { return -1; }
+	image = frame.image;
 
 	//calculate max. size
 	int result_rows = image.rows - input_template.rows + 1;
@@ -251,42 +536,274 @@ int SyncCamera::pattern_matching(int match_method) {
 }
 
 int SyncCamera::initialize_tracker(std::string tracker_type) {
+	return initialize_tracker(tracking_frame.image, tracker_type);
+}
+
+int SyncCamera::initialize_tracker(const Mat &image, std::string tracker_type) {
 	if(tracker_is_initialized) {
 		tracker.release();
 		tracker_is_initialized = 0;
 	}
-	if(!tracker_is_initialized) {
-		if(tracker_type=="MEDIANFLOW") {
-			tracker = TrackerMedianFlow::create();
-		}
-		else if(tracker_type=="KCF") {
-			tracker = TrackerKCF::create();
-		} else return -1;
-	}
-	//initialize tracker
-	tracker->init(tracking_image,tracking_rectangle);
+	this->tracker_type = tracker_type;
+
+	// cost is unknown yet, start with the pattern at a size that is cheap to track
+	track_cost_ms = 0.0;
+	track_scale = 1.0;
+	if(track_budget_ms > 0 && !tracking_rectangle.empty())
+		track_scale = std::max(std::min(1.0, TRACK_TARGET_START / std::min(tracking_rectangle.width, tracking_rectangle.height)),
+		                       track_scale_floor());
+
+	if(!start_tracker(image)) return -1;
 	tracker_is_initialized = 1;
 	return 0;
 }
 
+bool SyncCamera::start_tracker(const Mat &image) {
+	if(tracker_type=="MEDIANFLOW") {
+		tracker = TrackerMedianFlow::create();
+	}
+	else if(tracker_type=="KCF") {
+		tracker = TrackerKCF::create();
+	} else return false;
+
+	if(track_scale >= 1.0) {
+		tracker->init(image,tracking_rectangle);
+		return true;
+	}
+
+	resize(image, track_small, Size(), track_scale, track_scale, INTER_AREA);
+	tracker->init(track_small, scale_rect(tracking_rectangle, track_scale));
+	return true;
+}
+
+double SyncCamera::track_scale_floor() const {
+	double size = std::min(tracking_rectangle.width, tracking_rectangle.height);
+	if(size <= 0) return 1.0;
+	return std::min(1.0, std::max(TRACK_SCALE_MIN, TRACK_TARGET_MIN / size));
+}
+
+void SyncCamera::set_track_budget(double ms) {
+	track_budget_ms = std::max(0.0, ms);
+}
+
 int SyncCamera::track_next() {
-	int return_value = 0;
-	if (!cap.isOpened() || tracker_is_initialized != 1) { return -2; }
-	cap >> tracking_image;
-	bool ok = tracker->update(tracking_image,tracking_rectangle);  //update tracker
-	if(ok) { //if successful, return new x-coordinate
-		return_value = (int)(tracking_rectangle.x + tracking_rectangle.width/2);
-		return return_value;
+	if (!source || tracker_is_initialized != 1) { return -2; }
+	if (!next_frame(tracking_frame)) { return -1; }
+	return track_next(tracking_frame.image);
+}
+
+int SyncCamera::track_next(const Mat &image) {
+	if (tracker_is_initialized != 1) { return -2; }
+
+	auto start = std::chrono::steady_clock::now();
+	bool ok;
+	if(track_scale >= 1.0) {
+		ok = tracker->update(image,tracking_rectangle);  //update tracker
+	} else {
+		resize(image, track_small, Size(), track_scale, track_scale, INTER_AREA);
+		Rect2d small;
+		ok = tracker->update(track_small, small);
+		if(ok) tracking_rectangle = scale_rect(small, 1.0 / track_scale);
 	}
-	else {
-		return -1;
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	track_cost_ms = track_cost_ms > 0 ? track_cost_ms + TRACK_COST_SMOOTHING * (ms - track_cost_ms) : ms;
+
+	if(!ok) { return -1; }
+
+	if(track_budget_ms > 0) {
+		// tracking cost grows with the pixel count, so with the square of the scale
+		double want = track_scale * std::sqrt(track_budget_ms / track_cost_ms);
+		want = std::max(track_scale_floor(), std::min(1.0, want));
+		if(std::abs(want - track_scale) > TRACK_RESCALE_STEP * track_scale) {
+			// trackers keep their model at one size, start over at the new one
+			track_cost_ms *= (want * want) / (track_scale * track_scale); // expected cost at the new scale
+			track_scale = want;
+			start_tracker(image);
+		}
 	}
+
+	//if successful, return new x-coordinate
+	return (int)(tracking_rectangle.x + tracking_rectangle.width/2);
 }
 
-void SyncCamera::flush_frames(int seconds) {
-	if(!cap.isOpened()) return;
-	int j = cam_fps * seconds;
-	for(int i=0;i<j;i++)
-		cap.grab();
-	return;
+
+static int xioctl(int fd, unsigned long request, void *arg) {
+	int ret;
+	do ret = ioctl(fd, request, arg);
+	while(0> ret && errno == EINTR);
+	return ret;
+}
+
+V4L2Source::V4L2Source(const std::string &path) {
+	fd = open(path.c_str(), O_RDWR | O_NONBLOCK);
+	if(0> fd)
+		throw std::system_error(errno, std::system_category(), path);
+
+	v4l2_capability caps {};
+	if(0> xioctl(fd, VIDIOC_QUERYCAP, &caps) || !(caps.capabilities & V4L2_CAP_VIDEO_CAPTURE) || !(caps.capabilities & V4L2_CAP_STREAMING)) {
+		close(fd);
+		throw std::system_error(ENODEV, std::system_category(), path + " can't stream");
+	}
+
+	try {
+		stream_on();
+	} catch(...) {
+		close(fd);
+		throw;
+	}
+}
+
+V4L2Source::~V4L2Source() {
+	stream_off();
+	close(fd);
+}
+
+void V4L2Source::set_resolution(u32 width, u32 height) {
+	this->width = width;
+	this->height = height;
+	stream_off();
+	stream_on();
+}
+
+void V4L2Source::stream_on() {
+	// a failure halfway leaves nothing mapped or requested behind
+	try {
+		v4l2_format fmt {};
+		fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		fmt.fmt.pix.width = width;
+		fmt.fmt.pix.height = height;
+		fmt.fmt.pix.field = V4L2_FIELD_NONE;
+
+		// only intensity is needed, take it without any conversion if possible
+		format = 0;
+		for(u32 pixfmt : { V4L2_PIX_FMT_GREY, V4L2_PIX_FMT_YUYV }) {
+			fmt.fmt.pix.pixelformat = pixfmt;
+			if(0 == xioctl(fd, VIDIOC_S_FMT, &fmt) && fmt.fmt.pix.pixelformat == pixfmt) {
+				format = pixfmt;
+				break;
+			}
+		}
+		if(!format)
+			throw std::system_error(EINVAL, std::system_category(), "no GREY or YUYV format");
+
+		// the driver may have picked another size
+		width = fmt.fmt.pix.width;
+		height = fmt.fmt.pix.height;
+		stride = fmt.fmt.pix.bytesperline;
+
+		v4l2_requestbuffers req {};
+		req.count = BUFFERS;
+		req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		req.memory = V4L2_MEMORY_MMAP;
+		if(0> xioctl(fd, VIDIOC_REQBUFS, &req))
+			throw std::system_error(errno, std::system_category(), "VIDIOC_REQBUFS");
+
+		for(u32 i = 0; i < req.count; i++) {
+			v4l2_buffer buf {};
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			buf.index = i;
+			if(0> xioctl(fd, VIDIOC_QUERYBUF, &buf))
+				throw std::system_error(errno, std::system_category(), "VIDIOC_QUERYBUF");
+
+			void *start = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buf.m.offset);
+			if(start == MAP_FAILED)
+				throw std::system_error(errno, std::system_category(), "mmap");
+			buffers.push_back({start, buf.length});
+
+			if(0> xioctl(fd, VIDIOC_QBUF, &buf))
+				throw std::system_error(errno, std::system_category(), "VIDIOC_QBUF");
+		}
+
+		v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		if(0> xioctl(fd, VIDIOC_STREAMON, &type))
+			throw std::system_error(errno, std::system_category(), "VIDIOC_STREAMON");
+	} catch(...) {
+		stream_off();
+		throw;
+	}
+}
+
+void V4L2Source::stream_off() {
+	v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	xioctl(fd, VIDIOC_STREAMOFF, &type);
+	dequeued = -1;
+
+	for(const Buffer &buf : buffers)
+		munmap(buf.start, buf.length);
+	buffers.clear();
+
+	v4l2_requestbuffers req {};
+	req.count = 0;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	xioctl(fd, VIDIOC_REQBUFS, &req);
+}
+
+bool V4L2Source::acquire(Mat &view, clock::time_point &time) {
+	pollfd pfd { fd, POLLIN, 0 };
+	if(0>= poll(&pfd, 1, 1000))
+		return false;
+
+	v4l2_buffer buf {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	if(0> xioctl(fd, VIDIOC_DQBUF, &buf))
+		return false;
+	dequeued = buf.index;
+
+	// monotonic driver timestamps share their clock with std::chrono::steady_clock
+	if(buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		time = clock::time_point(std::chrono::duration_cast<clock::duration>(
+		           std::chrono::seconds(buf.timestamp.tv_sec) + std::chrono::microseconds(buf.timestamp.tv_usec)));
+	else
+		time = clock::now();
+
+	view = Mat(height, width, format == V4L2_PIX_FMT_GREY ? CV_8UC1 : CV_8UC2, buffers[buf.index].start, stride);
+	return true;
+}
+
+void V4L2Source::release() {
+	if(0> dequeued) return;
+
+	v4l2_buffer buf {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = dequeued;
+	xioctl(fd, VIDIOC_QBUF, &buf);
+	dequeued = -1;
+}
+
+
+FileSource::FileSource(const std::string &path, bool realtime)
+    : file(path)
+    , realtime(realtime)
+{
+	if(!file.isOpened())
+		throw std::runtime_error("failed to open " + path);
+
+	double fps = file.get(CAP_PROP_FPS);
+	period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / (fps > 0 ? fps : 30)));
+}
+
+void FileSource::set_resolution(u32 width, u32 height) {
+	size = Size(width, height);
+}
+
+bool FileSource::acquire(Mat &view, clock::time_point &time) {
+	if(realtime && next != clock::time_point())
+		std::this_thread::sleep_until(next);
+
+	if(!file.read(image))
+		return false;
+
+	time = clock::now();
+	next = time + period;
+
+	// act like a camera set to the requested resolution
+	if(size.area() > 0 && image.size() != size)
+		resize(image,image,size,0,0,INTER_AREA);
+
+	view = image;
+	return true;
 }
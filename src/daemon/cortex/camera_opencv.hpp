@@ -1,36 +1,258 @@
 #pragma once
 
 #include "types.hpp"
+#include "frame_ring.hpp"
+#include "seqlock.hpp"
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/video.hpp>
 #include <opencv2/tracking/tracker.hpp>
 #include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+
+namespace zbar { class ImageScanner; }
+
+/**
+ * @brief Outcome of tracking one frame
+ */
+struct CamResult {
+	i32 x = -2;               ///< X-coordinate of the pattern center, -1 if it was lost, -2 if there is no result yet
+	f32 confidence = 0.0;     ///< Match value of the pattern when it was acquired, 0 if lost
+	FrameRing::clock::time_point time; ///< Capture time of the frame
+	u64 seq = 0;              ///< Sequence number of the result, increases with every result, also a loss without a new frame
+	u64 frame = 0;            ///< Sequence number of the frame
+	f32 frame_ms = 0.0;       ///< Time the tracker spent on the frame in milliseconds, smoothed
+	f32 scale = 1.0;          ///< Frame scale the tracker ran at
+};
+
+/**
+ * @brief Source of frames for the capture thread
+ */
+struct FrameSource {
+	using clock = FrameRing::clock;
+
+	virtual ~FrameSource() = default;
+
+	/**
+	 * @brief Requests a frame size, the source may choose the closest one it supports
+	 * @param width width in pixels
+	 * @param height height in pixels
+	 */
+	virtual void set_resolution(u32 width, u32 height) = 0;
+	/**
+	 * @brief Waits for the next frame
+	 * @param view set to the frame, may point into driver memory and stays valid until release()
+	 * @param time set to the time the frame was captured
+	 * @return false if no frame is available
+	 */
+	virtual bool acquire(cv::Mat &view, clock::time_point &time) = 0;
+	/**
+	 * @brief Hands the last acquired frame back to the source
+	 */
+	virtual void release() {}
+};
+
+/**
+ * @brief V4L2 memory mapped streaming
+ *
+ * Requests raw GREY or YUYV frames, so there is no JPEG decoding. Acquired frames wrap the
+ * mapped driver buffer without copying: GREY frames are CV_8UC1, YUYV frames are CV_8UC2
+ * with the Y plane in channel 0.
+ */
+struct V4L2Source : FrameSource {
+	/**
+	 * @param path Video device file like /dev/video0
+	 * @throws std::system_error if the device can't stream
+	 */
+	V4L2Source(const std::string &path);
+	~V4L2Source();
+
+	void set_resolution(u32 width, u32 height) override;
+	bool acquire(cv::Mat &view, clock::time_point &time) override;
+	void release() override;
+
+private:
+	static constexpr u32 BUFFERS = 4;
+
+	void stream_on();
+	void stream_off();
+
+	struct Buffer {
+		void *start;
+		size_t length;
+	};
+
+	int fd = -1;
+	u32 width = 640, height = 480, stride = 0, format = 0;
+	std::vector<Buffer> buffers;
+	int dequeued = -1;
+};
+
+/**
+ * @brief Recorded video file or image sequence (e.g. img_%03d.png) to run without a camera
+ */
+struct FileSource : FrameSource {
+	/**
+	 * @param path video file or printf-like pattern of an image sequence
+	 * @param realtime deliver frames at the recorded frame rate instead of as fast as possible
+	 * @throws std::runtime_error if the file can't be read
+	 */
+	FileSource(const std::string &path, bool realtime = true);
+
+	void set_resolution(u32 width, u32 height) override;
+	bool acquire(cv::Mat &view, clock::time_point &time) override;
+
+private:
+	cv::VideoCapture file;
+	cv::Mat image;
+	cv::Size size;
+	bool realtime;
+	clock::duration period;
+	clock::time_point next;
+};
 
 /**
  * @brief The SyncCamera class
  * @author Johannes Eichenseer
  */
 class SyncCamera {
-	cv::VideoCapture cap;
-	cv::Mat input_template;
-	cv::Mat tracking_image;
+public:
+	/**
+	 * @brief Strategies for multi-scale template matching
+	 */
+	enum class SearchMode {
+		Exhaustive, ///< Match every scale on the full frame
+		Pyramid,    ///< Find candidates on a downscaled frame, refine them in small regions at full resolution
+	};
+
+	/**
+	 * @brief Channels the frames and the template are matched in
+	 */
+	enum class ColorMode {
+		Gray,  ///< Intensity only, a third of the matching cost
+		Color, ///< BGR
+	};
+
+private:
+	/**
+	 * @brief Best template match at one scale
+	 */
+	struct Match {
+		double value = 0.0; ///< Normalized match quality
+		cv::Rect2d rect;    ///< Matched area in full frame coordinates
+		double scale = 0.0; ///< Frame scale the template matched at, 0 if there was no match
+	};
+
+	static constexpr double PYRAMID_COARSE = 0.25;     ///< Downscale factor of the coarse pyramid level
+	static constexpr int PYRAMID_TEMPLATE_MIN = 12;    ///< Minimal template size in pixels on the coarse level
+	static constexpr size_t PYRAMID_CANDIDATES = 3;    ///< Number of coarse candidates to refine
+	static constexpr int REACQUIRE_ATTEMPTS = 4;       ///< Frames searched around the lost pattern before a global search
+	static constexpr int REACQUIRE_SCALES = 2;         ///< Scale steps above and below the last match to search
+	static constexpr double TRACK_SCALE_MIN = 0.2;     ///< Smallest frame scale the tracker runs at
+	static constexpr double TRACK_TARGET_MIN = 24.0;   ///< Minimal size in pixels of the tracked pattern after downscaling
+	static constexpr double TRACK_TARGET_START = 64.0; ///< Size in pixels the pattern is downscaled to before the cost is known
+	static constexpr double TRACK_COST_SMOOTHING = 0.2; ///< Weight of the newest frame in the smoothed tracking cost
+	static constexpr double TRACK_RESCALE_STEP = 0.15; ///< Relative scale change needed to reinitialize the tracker
+
+	std::unique_ptr<FrameSource> source;
+	cv::Mat pattern_source;   ///< template as loaded
+	cv::Mat input_template;   ///< template in the color mode
+	cv::Mat pattern_coarse;   ///< template on the coarse pyramid level
+	double pattern_coarse_scale = PYRAMID_COARSE;
+	FrameRing frames;
+	std::thread capture_thread;
+	std::atomic<bool> capturing {false};
+	FrameRing::Frame tracking_frame;
+	FrameRing::Frame barcode_frame;
+	std::unique_ptr<zbar::ImageScanner> scanner; ///< reused for every scan, configured once
+	cv::Mat barcode_gray;     ///< intensity buffer for frames that are not grey already
+	cv::Rect barcode_roi;     ///< area scanned for barcodes, empty for the full frame
+	std::thread barcode_thread;
+	std::atomic<bool> scanning {false};
 	cv::Rect2d tracking_rectangle;
 	cv::Ptr<cv::Tracker> tracker;
 	int tracker_is_initialized = 0;
-	int cam_fps = 0;
+	std::string tracker_type;
+	cv::Mat track_small;      ///< downscaled frame the tracker runs on
+	double track_budget_ms = 0.0;
+	double track_scale = 1.0;
+	double track_cost_ms = 0.0;
 	double matchval = 0.7;
+	SearchMode search_mode = SearchMode::Exhaustive;
+	ColorMode color_mode = ColorMode::Gray;
+	int match_threads = 1;
+	SeqLock<CamResult> result;
+	u64 result_seq = 0;
+	std::function<void()> result_cb;
+
+	/**
+	 * @brief Creates and initializes a tracker on the image at the current track_scale
+	 * @return false if the tracker type is unknown
+	 */
+	bool start_tracker(const cv::Mat &image);
+	/**
+	 * @return Scale at which the tracked pattern keeps at least TRACK_TARGET_MIN pixels
+	 */
+	double track_scale_floor() const;
+	/**
+	 * @brief Stores the tracking result of the current frame and notifies the consumer
+	 */
+	void publish(i32 x, f32 confidence);
+
+	/**
+	 * @brief Capture thread loop, grabs frames into the frame ring until stop_capture()
+	 */
+	void capture();
+	/**
+	 * @brief Waits for a frame newer than the given one and copies it
+	 * @param frame frame to update
+	 * @return false if the camera didn't deliver a new frame in time
+	 */
+	bool next_frame(FrameRing::Frame &frame);
+	/**
+	 * @brief Derives the matching templates from pattern_source in the current color mode
+	 */
+	void prepare_pattern();
+
+	/**
+	 * @brief Matches the template against a scaled region of an image
+	 * @param image full frame
+	 * @param match_method the CV match method
+	 * @param scale scale the region is resized with before matching
+	 * @param roi region of the frame to search in
+	 * @return the best match, scale is 0 if the template didn't fit into the region
+	 */
+	Match match_scale(const cv::Mat &image, int match_method, double scale, cv::Rect roi) const;
+	/**
+	 * @brief Matches every scale on the whole frame
+	 */
+	Match search_exhaustive(const cv::Mat &image, int match_method, int iterations) const;
+	/**
+	 * @brief Coarse-to-fine search, see SearchMode::Pyramid
+	 */
+	Match search_pyramid(const cv::Mat &image, int match_method, int iterations) const;
 
 public:
 	/**
 	 * @brief SyncCamera
-	 * @param cam_path Video device file like /dev/video0
+	 * @param cam_path Video device file like /dev/video0, or a recording to replay (see FileSource)
 	 * @param pattern_path Image file
 	 */
 	SyncCamera(const std::string& cam_path, const std::string& pattern_path);
 	~SyncCamera();
+	/**
+	 * @brief Starts grabbing frames on a dedicated thread, does nothing if already running
+	 */
+	void start_capture();
+	/**
+	 * @brief Stops and joins the capture thread
+	 */
+	void stop_capture();
 	/**
 	 * @brief Set the camera resolution
+	 * @note Has to be called before the capture is started
 	 * @param width width in pixels
 	 * @param height height in pixels
 	 */
@@ -41,6 +263,18 @@ public:
 	 * @param pattern path to a pattern file
 	 */
 	void set_pattern(cv::String pattern);
+	/**
+	 * @brief Selects the channels frames and template are matched in
+	 * @note Has to be called before the capture is started
+	 * @param mode color mode (defaults to ColorMode::Gray)
+	 */
+	void set_color_mode(ColorMode mode);
+	/**
+	 * @brief Converts a frame from a FrameSource into the color mode, the capture thread does this for camera frames
+	 * @param in GREY, YUYV or BGR frame
+	 * @param out converted frame
+	 */
+	void convert_frame(const cv::Mat &in, cv::Mat &out) const;
 	/**
 	 * @brief set_matchval
 	 * @param value minimum quality to get accepted as a match, values between 0 and 1 (good matches are >0.7)
@@ -55,11 +289,86 @@ public:
 	 */
 	double pattern_matching_scaled(int match_method = CV_TM_CCOEFF_NORMED, int iterations = 20);
 	/**
-	 * @brief Scans an image for a barcode
+	 * @brief Multi-scale template matching on a given image instead of the next camera frame
+	 * @param image image to search, the match gets drawn into it
+	 * @param match_method the CV match method
+	 * @param iterations number of downscaled images to process
+	 * @return match value of the best match, 0 if nothing was found
+	 */
+	double pattern_matching_scaled(cv::Mat &image, int match_method = CV_TM_CCOEFF_NORMED, int iterations = 20);
+	/**
+	 * @brief Searches the next frame only around the last tracking rectangle and at scales near its size
+	 * @param match_method the CV match method
+	 * @param attempt number of failed attempts so far, widens the search window
+	 * @param iterations number of scale steps of the full sweep, to pick the neighbouring scales from
+	 * @return match value, 0 if nothing was found, -1 on error
+	 */
+	double reacquire(int match_method = CV_TM_CCOEFF_NORMED, int attempt = 0, int iterations = 20);
+	/**
+	 * @overload double reacquire(int match_method, int attempt, int iterations)
+	 * @param image image to search instead of the next camera frame
+	 */
+	double reacquire(const cv::Mat &image, int match_method = CV_TM_CCOEFF_NORMED, int attempt = 0, int iterations = 20);
+	/**
+	 * @brief Selects the strategy of pattern_matching_scaled()
+	 * @param mode search strategy (defaults to SearchMode::Exhaustive)
+	 */
+	void set_search_mode(SearchMode mode);
+	/**
+	 * @brief Spreads the exhaustive scale sweep over several threads
+	 *
+	 * The result is the same as with a single thread.
+	 * @param threads number of parallel scale stripes, 1 disables it, 0 uses all cores
+	 */
+	void set_match_threads(int threads);
+	/**
+	 * @brief Tracks on downscaled frames to keep the tracker within a per frame time budget
+	 *
+	 * The scale follows the measured tracking cost, but never shrinks the pattern
+	 * below a few dozen pixels. Results stay in full resolution coordinates.
+	 * @param ms target tracking time per frame in milliseconds, 0 tracks at full resolution
+	 */
+	void set_track_budget(double ms);
+	/**
+	 * @return Smoothed time the tracker spent per frame in milliseconds
+	 */
+	double get_track_time() const { return track_cost_ms; }
+	/**
+	 * @return Frame scale the tracker currently runs at
+	 */
+	double get_track_scale() const { return track_scale; }
+	/**
+	 * @return the rectangle of the last match or tracker update
+	 */
+	const cv::Rect2d &get_tracking_rectangle() const { return tracking_rectangle; }
+	/**
+	 * @brief Restricts barcode scans to a part of the frame
+	 * @param roi area in frame coordinates, an empty rectangle scans the full frame
+	 */
+	void set_barcode_roi(const cv::Rect &roi);
+	/**
+	 * @brief Scans the next camera frame for a barcode
 	 * @param show_rectangle If set to 1, draws a rectangle around the barcode in the provided image (defaults to 0)
-	 * @return Barcod#include "opencv2/opencv.hpp"e in numerical form
+	 * @return Barcode in numerical form, 0 if there is none, -1 on error
 	 */
 	long scan_barcode(int show_rectangle=0);
+	/**
+	 * @overload long scan_barcode(int show_rectangle)
+	 * @param image grey or BGR image to scan instead of the next camera frame
+	 */
+	long scan_barcode(cv::Mat &image, int show_rectangle=0);
+	/**
+	 * @brief Scans every new camera frame for barcodes in a separate thread
+	 *
+	 * The scanner reads from the same frame ring as the tracker, so both see
+	 * every captured frame without grabbing from the camera twice.
+	 * @param callback called from the scanner thread when a barcode comes into view
+	 */
+	void start_barcode_scan(std::function<void(long)> callback);
+	/**
+	 * @brief Stops and joins the scanner thread
+	 */
+	void stop_barcode_scan();
 	/**
 	 * @brief Searches for a template pattern in an image
 	 * @param match_method normalized OpenCV match method (defaults to CV_TM_SQDIFF_NORMED)
@@ -73,6 +382,11 @@ public:
 	 * @return -1 on tracking error, -2 if tracker is not initialized, else X-coordinate of the center of the image
 	 */
 	int track_next();
+	/**
+	 * @overload int track_next()
+	 * @param image image to track in instead of the next camera frame
+	 */
+	int track_next(const cv::Mat &image);
 	/**
 	 * @brief Initializes the motion tracker from a previously detected pattern
 	 * @param tracker_type MEDIANFLOW and KCF are supported
@@ -80,14 +394,29 @@ public:
 	 */
 	int initialize_tracker(std::string tracker_type = "MEDIANFLOW");
 	/**
-	 * @brief SyncCamera::FlushFrames Keeps camera busy so we don't read stale frames
-	 * @param seconds seconds to delay
+	 * @overload int initialize_tracker(std::string tracker_type)
+	 * @param image image the pattern was detected in
+	 */
+	int initialize_tracker(const cv::Mat &image, std::string tracker_type = "MEDIANFLOW");
+	/**
+	 * @brief Runs pattern search and tracking on the camera frames, never returns
+	 *
+	 * Every tracked frame produces a CamResult, see get_result() and on_result().
+	 */
+	void start_sync_camera();
+	/**
+	 * @brief Sets a function to be called from the camera thread whenever a new result is available
+	 * @param callback must be cheap and thread safe, e.g. posting to an event loop
+	 * @note Has to be called before start_sync_camera()
+	 */
+	void on_result(std::function<void()> callback);
+	/**
+	 * @return the newest tracking result, safe to call from any thread
 	 */
-	void flush_frames(int seconds);
-	void start_sync_camera(std::atomic<int> *return_value);
+	CamResult get_result() const;
 	/**
 	 * @brief ContinuousScanBarcode Keeps scanning for barcodes
-	 * @param return_barcode A pointer to a barcode_thread_data structure
+	 * @param return_barcode Receives the first barcode found
 	 * @param retries number of tries
 	 * @param show_rectangle show match rectangle
 	 * @return Numeric barcode in exit message
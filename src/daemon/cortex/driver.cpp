@@ -2,11 +2,21 @@
 
 #include "util.hpp"
 
-#include "proto-def.hpp"
+#include <boost/asio/write.hpp>
 
+#include <algorithm>
 
 constexpr auto TIMEOUT_TIME = std::chrono::milliseconds(100);
 constexpr auto TIMEOUT_RETRIES = 10;
+constexpr auto RTO_INIT = TIMEOUT_TIME;                  // until the first RTT sample
+constexpr auto RTO_MIN = std::chrono::milliseconds(2);
+constexpr auto RTO_MAX = std::chrono::milliseconds(200);
+constexpr auto RTO_GRANULARITY = std::chrono::microseconds(500);
+constexpr auto ULTRA_SONIC_TIME = std::chrono::microseconds(proto::ULTRA_SONIC_TIMEOUT_US); // longest echo the firmware waits for
+constexpr auto ULTRA_SONIC_PAUSE = std::chrono::microseconds(proto::ULTRA_SONIC_PAUSE_US);  // between two pings of a burst
+constexpr auto STREAM_CHECK_TIME = std::chrono::milliseconds(500);
+constexpr auto STREAM_SILENT_PERIODS = 4;
+constexpr auto DROP_WARN_TIME = std::chrono::seconds(1);  // least time between two warnings about a full queue
 
 using namespace proto;
 
@@ -47,13 +57,69 @@ const def::Scale Driver::limit
 };
 
 
+static const char* TYPE_NAMES[] { "ping", "version", "motor", "ultra_sonic", "analog", "subscribe", "ultra_sonic_burst" };
+static_assert(sizeof(TYPE_NAMES) / sizeof(*TYPE_NAMES) == Type::_MAX, "name every packet type");
+
+void LinkStats::Type::add_rtt(std::chrono::steady_clock::duration rtt)
+{
+	const f64 ms = std::chrono::duration<f64, std::milli>(rtt).count();
+	rtt_sum_ms += ms;
+	rtt_max_ms = std::max(rtt_max_ms, f32(ms));
+
+	const auto us = std::chrono::duration_cast<std::chrono::microseconds>(rtt).count();
+	usz i = 0;
+	while(i < RTT_BUCKETS - 1 && us > i64(RTT_BUCKET_US) << i)
+		i++;
+	this->rtt[i]++;
+}
+
+f32 LinkStats::Type::rtt_quantile(f32 p) const
+{
+	u32 total = 0;
+	for(u32 n: rtt) total += n;
+	if(!total) return 0.0;
+
+	const u32 rank = u32(p * (total - 1));
+	u32 seen = 0;
+	for(usz i = 0; i < RTT_BUCKETS - 1; i++)
+	{
+		seen += rtt[i];
+		if(seen > rank)
+			return std::min(f32(RTT_BUCKET_US << i) / 1000, rtt_max_ms);
+	}
+	return rtt_max_ms;
+}
+
+std::string LinkStats::json() const
+{
+	std::string out = fmt::format("{{\"queue_max\":{},\"rx_garbage\":{},\"dropped\":{},\"types\":{{", queue_max, rx_garbage, dropped);
+	for(usz i = 0; i < types.size(); i++)
+	{
+		const Type &t = types[i];
+
+		std::string hist;
+		for(u32 n: t.rtt)
+			hist += fmt::format("{}{}", hist.empty() ? "" : ",", n);
+
+		out += fmt::format("{}\"{}\":{{\"sent\":{},\"replies\":{},\"errors\":{},\"retries\":{},\"timeouts\":{},\"dropped\":{},"
+		                   "\"superseded\":{},\"stream\":{},\"stream_lost\":{},"
+		                   "\"rtt_mean_ms\":{:.3f},\"rtt_p50_ms\":{:.3f},\"rtt_p99_ms\":{:.3f},\"rtt_max_ms\":{:.3f},\"rtt_hist\":[{}],"
+		                   "\"srtt_ms\":{:.3f},\"rto_ms\":{:.3f}}}",
+		                   i ? "," : "", TYPE_NAMES[i], t.sent, t.replies, t.errors, t.retries, t.timeouts, t.dropped,
+		                   t.superseded, t.stream, t.stream_lost,
+		                   t.replies ? t.rtt_sum_ms / t.replies : 0.0, t.rtt_quantile(0.5), t.rtt_quantile(0.99), t.rtt_max_ms,
+		                   hist, t.srtt_ms, t.rto_ms);
+	}
+	return out + "}}";
+}
+
 Driver::Driver(boost::asio::io_context& ctx, const char* dev_path)
     : logger(new_loggr("driver"))
     , dev(ctx, dev_path)
     , timer(ctx)
-    , timeout_num(0)
-    , parse_state(SYNC)
-    , speed_ctrl{ steady_timer(ctx), Speed::STOP }
+    , seq_next(0)
+    , stream_timer(ctx)
+    , speed_ctrl{ steady_timer(ctx), Speed::STOP, 0, false, true, false, {} }
 {
 	dev.set_option(serial_port::baud_rate(BAUD /*115200*/));
 	dev.set_option(serial_opts::hang_up(false));
@@ -66,6 +132,11 @@ Driver::Driver(boost::asio::io_context& ctx, const char* dev_path)
 			logger->error("failed to fetch version: {}", ec.message());
 			dev.close();
 		}
+		else if(v < FW_VERSION)
+		{
+			logger->error("firmware version {} is too old, need {}", v, FW_VERSION);
+			dev.close();
+		}
 		else
 			logger->debug("firmware version {}", v);
 	});
@@ -74,109 +145,521 @@ Driver::Driver(boost::asio::io_context& ctx, const char* dev_path)
 void Driver::drive(i32 speed)
 {
 	speed_ctrl.curr = Speed::STOP + clamp(speed, limit.min, limit.max);
+	motor_send();
 
+	// keep the firmware watchdog fed while moving, a running feeder isn't restarted on every change
 	if(speed_ctrl.curr == Speed::STOP)
+	{
+		speed_ctrl.feeding = false;
 		speed_ctrl.feeder.cancel();
+	}
+	else if(!speed_ctrl.feeding)
+	{
+		speed_ctrl.feeding = true;
+		speed_ctrl.feeder.expires_after(TIMEOUT_TIME);
+		speed_ctrl.feeder.async_wait(bind_memory(handlers, [this](auto ec){ wd_feed(ec); }));
+	}
+}
+
+void Driver::gap(u8 pin, Callback callback)
+{
+	send(Type::ULTRA_SONIC, pin, std::move(callback));
+}
+
+void Driver::gap(u8 pin, u8 samples, GapCallback callback)
+{
+	samples = clamp<u8>(samples, 1, MAX_SAMPLES);
+	const u8 data[] { pin, samples };
+	send(Type::ULTRA_SONIC, data, sizeof(data), gap_reply(samples, std::move(callback)));
+}
+
+u8 Driver::Gaps::at(u8 pin) const
+{
+	if(pin >= 16 || !(pins & (1u << pin)))
+		return 255;
+
+	// index is the number of measured pins below
+	const usz i = usz(__builtin_popcount(pins & ((1u << pin) - 1)));
+	return i < count ? mm[i] : 255;
+}
+
+void Driver::gaps(u16 pins, GapsCallback callback)
+{
+	const u8 data[] { u8(pins), u8(pins >> 8) };
+	send(Type::ULTRA_SONIC_BURST, data, sizeof(data), Reply([pins, cb = std::move(callback)](auto ec, const u8* data, u8 len)
+	{
+		if(!cb) return;
+
+		Gaps res;
+		res.pins = pins;
+		if(!ec && len != __builtin_popcount(pins))
+			ec = std::make_error_code(std::errc::protocol_error);
+		if(!ec)
+		{
+			res.count = len;
+			std::copy_n(data, len, res.mm.begin());
+		}
+		cb(ec, res);
+	}));
+}
+
+void Driver::analog(u8 pin, Callback callback)
+{
+	send(Type::ANALOG, pin, std::move(callback));
+}
+
+void Driver::version(Callback callback)
+{
+	send(Type::VERSION, nullptr, 0, std::move(callback));
+}
+
+void Driver::gap_stream(u8 pin, std::chrono::milliseconds period, Callback callback)
+{
+	subscribe(Type::ULTRA_SONIC, pin, period, 1, value_reply(std::move(callback)));
+}
+
+void Driver::gap_stream(u8 pin, std::chrono::milliseconds period, u8 samples, GapCallback callback)
+{
+	samples = clamp<u8>(samples, 1, MAX_SAMPLES);
+
+	// the firmware can't ping faster than that, readings would get lost
+	const auto busy = samples * (ULTRA_SONIC_TIME + ULTRA_SONIC_PAUSE);
+	period = std::max(period, std::chrono::duration_cast<std::chrono::milliseconds>(busy));
+
+	subscribe(Type::ULTRA_SONIC, pin, period, samples, gap_reply(samples, std::move(callback)));
+}
+
+void Driver::analog_stream(u8 pin, std::chrono::milliseconds period, Callback callback)
+{
+	subscribe(Type::ANALOG, pin, period, 1, value_reply(std::move(callback)));
+}
+
+void Driver::stop_stream(Type kind, u8 pin)
+{
+	auto it = std::find_if(streams.begin(), streams.end(), [&](auto& s){ return s.kind == kind && s.pin == pin; });
+	if(it == streams.end())
+		return;
+
+	streams.erase(it);
+	subscribe_send(kind, pin, 0, 1);
+
+	if(streams.empty())
+		stream_timer.cancel();
+}
+
+void Driver::subscribe(u8 kind, u8 pin, std::chrono::milliseconds period, u8 samples, Reply callback)
+{
+	const u16 period_ms = u16(clamp<i64>(period.count(), 1, 0xFFFF));
+
+	auto it = std::find_if(streams.begin(), streams.end(), [&](auto& s){ return s.kind == kind && s.pin == pin; });
+	if(it == streams.end())
+	{
+		streams.push_back({kind, pin, period_ms, samples, std::move(callback), 0, steady_timer::clock_type::now()});
+		if(streams.size() == 1)
+			stream_check({});
+	}
 	else
-		wd_feed({});
+	{
+		it->period_ms = period_ms;
+		it->samples = samples;
+		it->cb = std::move(callback);
+		it->last = steady_timer::clock_type::now();
+	}
+
+	subscribe_send(kind, pin, period_ms, samples);
 }
 
-void Driver::gap(u8 pin, std::function<void(std::error_code, u8)> callback)
+void Driver::subscribe_send(u8 kind, u8 pin, u16 period_ms, u8 samples)
 {
-	send(Type::ULTRA_SONIC, pin, callback);
+	// older firmware knows only single samples
+	const u8 data[] { kind, pin, u8(period_ms), u8(period_ms >> 8), samples };
+	send(Type::SUBSCRIBE, data, samples > 1 ? 5 : 4, Callback([this, kind, pin](auto ec, u8)
+	{
+		if(!ec) return;
+
+		logger->error("failed to subscribe 0x{:02x} on pin {}: {}", kind, pin, ec.message());
+		auto it = std::find_if(streams.begin(), streams.end(), [&](auto& s){ return s.kind == kind && s.pin == pin; });
+		if(it != streams.end() && it->cb)
+			it->cb(ec, nullptr, 0);
+	}));
 }
 
-void Driver::analog(u8 pin, std::function<void (std::error_code, u8)> callback)
+void Driver::on_stream(u8 kind, u8 seq, const u8* data, u8 len)
 {
-	send(Type::ANALOG, pin, callback);
+	if(len < 2) return;
+
+	auto it = std::find_if(streams.begin(), streams.end(), [&](auto& s){ return s.kind == kind && s.pin == data[0]; });
+	if(it == streams.end())
+	{
+		logger->debug("reading of unknown stream 0x{:02x} on pin {}", kind, data[0]);
+		return;
+	}
+
+	auto &stat = link.types[kind];
+	stat.stream++;
+	if(seq != it->seq)
+	{
+		logger->debug("stream 0x{:02x} on pin {} lost {} readings", kind, data[0], u8(seq - it->seq));
+		stat.stream_lost += u8(seq - it->seq);
+	}
+	it->seq = seq + 1;
+	it->last = steady_timer::clock_type::now();
+
+	if(it->cb)
+		it->cb({}, data + 1, len - 1);
 }
 
-void Driver::version(std::function<void (std::error_code, u8)> callback)
+void Driver::stream_check(std::error_code ec)
 {
-	send(Type::VERSION, 0, callback);
+	if(ec || streams.empty()) return;
+
+	const auto now = steady_timer::clock_type::now();
+	for(Stream &s: streams)
+	{
+		if(now - s.last < std::chrono::milliseconds(s.period_ms) * STREAM_SILENT_PERIODS + STREAM_CHECK_TIME)
+			continue;
+
+		logger->warn("stream 0x{:02x} on pin {} went silent, resubscribing", s.kind, s.pin);
+		s.last = now;
+		subscribe_send(s.kind, s.pin, s.period_ms, s.samples);
+	}
+
+	stream_timer.expires_after(STREAM_CHECK_TIME);
+	stream_timer.async_wait(bind_memory(handlers, [this](auto ec){ stream_check(ec); }));
 }
 
 void Driver::wd_feed(std::error_code ec)
 {
-	send(Type::MOTOR, speed_ctrl.curr);
+	if(ec || !speed_ctrl.feeding) return;
+
+	motor_send();
 
-	if(ec) return;
 	speed_ctrl.feeder.expires_after(TIMEOUT_TIME);
-	speed_ctrl.feeder.async_wait([this](auto ec){ wd_feed(ec); });
+	speed_ctrl.feeder.async_wait(bind_memory(handlers, [this](auto ec){ wd_feed(ec); }));
 }
 
-void Driver::send(u8 type, u8 value, std::function<void(std::error_code, u8 cm)> callback)
+void Driver::motor_send()
 {
-	if(q.size() > 16 && !(type == Type::MOTOR && value == Speed::STOP))
+	auto &m = speed_ctrl;
+	if(m.staged)
 	{
-		logger->warn("dropping {}:{}", u8(type), value);
+		// not written yet, replace the old speed in place
+		tx_next->data[HEADER_SIZE] = m.curr;
+		link.types[Type::MOTOR].superseded++;
+		logger->trace("TX {:02X} #{:3} {:3} (replaced)", u8(Type::MOTOR), m.seq, m.curr);
 		return;
 	}
 
-	logger->trace("TX {:02X} {:3}", u8(type), value);
+	const auto now = steady_timer::clock_type::now();
+	if(!m.acked && now - m.sent > TIMEOUT_TIME)
+		logger->debug("motor #{} unanswered", m.seq);
+
+	m.seq = seq_next++;
+	link.types[Type::MOTOR].sent++;
+	m.staged = true;
+	m.acked = false;
+	m.sent = now;
+
+	logger->trace("TX {:02X} #{:3} {:3}", u8(Type::MOTOR), m.seq, m.curr);
+
+	// jump ahead of everything waiting for the next write
+	u8 *out = tx_next->data.data();
+	std::copy_backward(out, out + tx_next->len, out + tx_next->len + MOTOR_SIZE);
+	*out++ = BYTE_SYNC;
+	*out++ = Type::MOTOR;
+	*out++ = m.seq;
+	*out++ = 1;
+	*out++ = m.curr;
+	*out++ = BYTE_END;
+	tx_next->len += MOTOR_SIZE;
+
+	send_start();
+}
 
-	std::ostream out(&buf_w);
-	out << '[' << char(type) << char(value) << ']';
-	out.flush();
+void Driver::send(u8 type, u8 value, Callback callback)
+{
+	send(type, &value, 1, std::move(callback));
+}
 
-	bool first = q.empty();
-	q.push_back({u8(type), callback});
+void Driver::send(u8 type, const u8* data, u8 len, Callback callback)
+{
+	send(type, data, len, value_reply(std::move(callback)));
+}
 
-	if(first)
-		send_start();
-	else
+Driver::Reply Driver::value_reply(Callback callback)
+{
+	return [cb = std::move(callback)](auto ec, const u8* data, u8 len)
+	{
+		if(!cb) return;
+
+		if(!ec && !len)
+			ec = std::make_error_code(std::errc::protocol_error);
+		cb(ec, ec ? 0 : data[0]);
+	};
+}
+
+Driver::Reply Driver::gap_reply(u8 samples, GapCallback callback)
+{
+	return [samples, cb = std::move(callback)](auto ec, const u8* data, u8 len)
+	{
+		if(!cb) return;
+
+		Gap gap;
+		if(!ec && len < (samples > 1 ? 2 : 1))
+			ec = std::make_error_code(std::errc::protocol_error);
+		if(!ec)
+		{
+			gap.mm = data[0];
+			gap.spread = samples > 1 ? data[1] : 0;
+			gap.samples = samples;
+		}
+		cb(ec, gap);
+	};
+}
+
+void Driver::send(u8 type, const u8* data, u8 len, Reply callback)
+{
+	if(q.full())
+	{
+		link.dropped++;
+		if(type < Type::_MAX)
+			link.types[type].dropped++;
+
+		// a stalled link drops every request, summarize instead of flooding the log
+		const auto now = steady_timer::clock_type::now();
+		if(now - drop_warned >= DROP_WARN_TIME)
+		{
+			logger->warn("queue full, dropped {} requests", link.dropped - drops_logged);
+			drops_logged = link.dropped;
+			drop_warned = now;
+		}
+		return;
+	}
+
+	Req r;
+	r.type = type;
+	r.len = std::min(len, MAX_DATA);
+	std::copy_n(data, r.len, r.data.begin());
+	r.cb = std::move(callback);
+	q.push(std::move(r));
+	link.queue_max = std::max(link.queue_max, u32(q.size()));
+
+	if(inflight_num >= WINDOW)
 		logger->trace("Q: {}", q.size());
+
+	pump();
+}
+
+void Driver::pump()
+{
+	bool sent = false;
+	for(Req &r: inflight)
+	{
+		if(q.empty())
+			break;
+		if(r.busy)
+			continue;
+
+		r = std::move(q.front());
+		q.pop();
+
+		r.busy = true;
+		r.seq = seq_next++;
+		r.tries = 0;
+		inflight_num++;
+		if(r.type < Type::_MAX)
+			link.types[r.type].sent++;
+		transmit(r);
+		sent = true;
+	}
+
+	if(sent)
+		timeout_start();
+}
+
+void Driver::transmit(Req& r)
+{
+	// back off exponentially while a request stays unanswered
+	r.rto = r.tries ? std::min<steady_timer::duration>(r.rto * 2, RTO_MAX) : rto(r.type, pings(r));
+	r.sent = steady_timer::clock_type::now();
+	r.deadline = r.sent + r.rto;
+	r.tries++;
+
+	if(tx_next->len + pkt_size(r.len) > TX_SIZE)
+	{
+		logger->trace("TX full, #{} waits for retry", r.seq);
+		return;
+	}
+
+	logger->trace("TX {:02X} #{:3} {:3}", r.type, r.seq, r.len ? r.data[0] : 0);
+
+	u8 *out = tx_next->data.data() + tx_next->len;
+	*out++ = BYTE_SYNC;
+	*out++ = r.type;
+	*out++ = r.seq;
+	*out++ = r.len;
+	out = std::copy_n(r.data.begin(), r.len, out);
+	*out++ = BYTE_END;
+	tx_next->len = usz(out - tx_next->data.data());
+
+	send_start();
 }
 
 void Driver::send_start()
 {
-//	logger->trace("SEND START: {:02x}", fmt::join(buffers_begin(buf_w.data()), buffers_end(buf_w.data()), " "));
-	dev.async_write_some(buf_w.data(), [this](auto ec, usz len){ send_handle(ec, len); });
+	// one write at a time, packets queued meanwhile go out with the next one
+	if(tx_busy->len || !tx_next->len)
+		return;
+
+	std::swap(tx_busy, tx_next);
+	speed_ctrl.staged = false;
+	async_write(dev, buffer(tx_busy->data, tx_busy->len), bind_memory(handlers, [this](auto ec, usz len){ send_handle(ec, len); }));
 }
 
 void Driver::send_handle(std::error_code ec, usz len)
 {
-//	logger->trace("SEND END ({})", len);
-	if(ec && !q.empty())
+	tx_busy->len = 0;
+
+	if(ec)
 	{
-		Req &r = q.front();
-		r.cb(ec, {});
-		q.pop_front();
+		if(ec.value() != boost::system::errc::operation_canceled)
+			logger->error("failed to write to driver: {}", ec.message());
+
+		// nothing of this will be answered
+		fail_inflight(ec);
 		return;
 	}
 
-	timeout_start();
+	send_start();
+}
+
+void Driver::fail_inflight(std::error_code ec)
+{
+	// callbacks may send new requests, so empty the window first
+	std::array<Reply, WINDOW> failed;
+	usz n = 0;
+	for(Req &r: inflight)
+	{
+		if(!r.busy) continue;
+		failed[n++] = std::move(r.cb);
+		r = Req();
+	}
+	inflight_num = 0;
+
+	for(usz i = 0; i < n; i++)
+		if(failed[i]) failed[i](ec, nullptr, 0);
+}
+
+void Driver::rtt_sample(u8 type, steady_timer::duration sample, u8 pings)
+{
+	RttEstimator &e = rtt[type][std::min(pings, MAX_SAMPLES)];
+	if(!e.valid)
+	{
+		e.srtt = sample;
+		e.rttvar = sample / 2;
+		e.valid = true;
+	}
+	else
+	{
+		const auto err = e.srtt > sample ? e.srtt - sample : sample - e.srtt;
+		e.rttvar = (3 * e.rttvar + err) / 4;
+		e.srtt = (7 * e.srtt + sample) / 8;
+	}
+
+	auto &stat = link.types[type];
+	stat.srtt_ms = std::chrono::duration<f32, std::milli>(e.srtt).count();
+	stat.rto_ms = std::chrono::duration<f32, std::milli>(rto(type, pings)).count();
+}
+
+u8 Driver::pings(const Req& r)
+{
+	switch(r.type)
+	{
+	case Type::ULTRA_SONIC:       return r.len < 2 ? 1 : std::max<u8>(r.data[1], 1);
+	case Type::ULTRA_SONIC_BURST: return r.len < 2 ? 0 : u8(__builtin_popcount(r.data[0] | (r.data[1] << 8)));
+	default:                      return 0;
+	}
+}
+
+steady_timer::duration Driver::rto(u8 type, u8 pings) const
+{
+	const RttEstimator *e = type < Type::_MAX ? &rtt[type][std::min(pings, MAX_SAMPLES)] : nullptr;
+	if(!e || !e->valid)
+		return std::max<steady_timer::duration>(RTO_INIT, pings * (ULTRA_SONIC_TIME + ULTRA_SONIC_PAUSE));
+
+	// every ping may legitimately take the whole echo time on top of the link
+	steady_timer::duration floor = RTO_MIN;
+	if(pings)
+		floor += pings * ULTRA_SONIC_TIME + (pings - 1) * ULTRA_SONIC_PAUSE;
+
+	const steady_timer::duration rto = e->srtt + std::max<steady_timer::duration>(RTO_GRANULARITY, 4 * e->rttvar);
+	return clamp<steady_timer::duration>(rto, floor, RTO_MAX);
 }
 
 void Driver::timeout_start()
 {
-	timer.expires_from_now(TIMEOUT_TIME);
-	timer.async_wait([this](auto ec)
+	const Req *next = nullptr;
+	for(const Req &r: inflight)
+		if(r.busy && (!next || r.deadline < next->deadline))
+			next = &r;
+
+	// a running wait that ends earlier looks again when it fires, restarting
+	// the timer for every packet would leave a canceled wait behind each time
+	if(!next || (timer_armed && timer_due <= next->deadline))
+		return;
+
+	timer_armed = true;
+	timer_due = next->deadline;
+	timer.expires_at(timer_due);
+	timer.async_wait(bind_memory(handlers, [this](auto ec)
 	{
 		if(ec) return;
 
+		timer_armed = false;
 		timeout_handle();
-	});
+	}));
 }
 
 void Driver::timeout_handle()
 {
-	timeout_num += 1;
-	if(timeout_num < TIMEOUT_RETRIES)
-	{
-		logger->trace("retry ({})", timeout_num);
-		send_start();
-	} else if(!q.empty())
+	const auto now = steady_timer::clock_type::now();
+
+	std::array<Reply, WINDOW> failed;
+	usz n = 0;
+	for(Req &r: inflight)
 	{
-		q.front().cb(std::make_error_code(std::errc::timed_out), {});
-		q.pop_front();
+		if(!r.busy || r.deadline > now)
+			continue;
+
+		if(r.tries < TIMEOUT_RETRIES)
+		{
+			logger->trace("retry #{} ({})", r.seq, r.tries);
+			if(r.type < Type::_MAX)
+				link.types[r.type].retries++;
+			transmit(r);
+		}
+		else
+		{
+			if(r.type < Type::_MAX)
+				link.types[r.type].timeouts++;
+			failed[n++] = std::move(r.cb);
+			r = Req();
+			inflight_num--;
+		}
 	}
+
+	// callbacks may send new requests, so call them last
+	for(usz i = 0; i < n; i++)
+		if(failed[i]) failed[i](std::make_error_code(std::errc::timed_out), nullptr, 0);
+
+	pump();
+	timeout_start();
 }
 
 void Driver::recv_start()
 {
 //	logger->trace("RECV START");
-	dev.async_read_some(buf_r.prepare(32), [this](auto ec, usz len) { recv_handle(ec, len); });
+	dev.async_read_some(buffer(rx.data() + rx_len, RX_SIZE - rx_len), bind_memory(handlers, [this](auto ec, usz len) { recv_handle(ec, len); }));
 }
 
 void Driver::recv_handle(std::error_code ec, usz len)
@@ -188,84 +671,108 @@ void Driver::recv_handle(std::error_code ec, usz len)
 		return;
 	}
 
-	buf_r.commit(len);
-//	logger->trace("RECV END: {:02x}", fmt::join(buffers_begin(buf_r.data()), buffers_end(buf_r.data()), " "));
-
+	rx_len += len;
 
-	bool stop = false;
-	do {
-		buffer_iter pkt_begin(buffers_begin(buf_r.data())),
-		            pkt_end(buffers_end(buf_r.data()));
+	usz pos = 0;
+	for(;;)
+	{
+		// drop garbage before the next packet
+		const usz sync = usz(std::find(rx.begin() + pos, rx.begin() + rx_len, BYTE_SYNC) - rx.begin());
+		link.rx_garbage += sync - pos;
+		pos = sync;
+		if(rx_len - pos < HEADER_SIZE)
+			break;
 
-		switch(parse_state)
-		{
-		case SYNC:
+		const u8 *pkt = rx.data() + pos;
+		const u8 dlen = pkt[3];
+		if(dlen > MAX_DATA)
 		{
-			buffer_iter sync = std::find(pkt_begin, pkt_end, BYTE_SYNC);
-			if(sync == pkt_end)
-			{
-				stop = true; break;
-			}
-			sync++;
-			buf_r.consume(usz(std::distance(pkt_begin, sync)));
-			pkt_begin = sync;
-			parse_state = DATA;
+			pos++; // not a header, search the next sync
+			link.rx_garbage++;
+			continue;
 		}
-		case DATA:
+		if(rx_len - pos < pkt_size(dlen))
+			break;
+		if(pkt[HEADER_SIZE + dlen] != BYTE_END)
 		{
-			if(buf_r.size() < PKT_SIZE-1)
-			{
-				stop = true; break;
-			}
-
-			auto tail = std::next(pkt_begin, PKT_SIZE-2);
-			if(*tail == BYTE_END)
-			{
-				pkt_end = std::next(tail);
-				on_packet(pkt_begin[0], pkt_begin[1]);
-				buf_r.consume(usz(std::distance(pkt_begin, pkt_end)));
-				buf_w.consume(PKT_SIZE);
-			}
-		}
-		default:
-			parse_state = SYNC;
+			pos++;
+			link.rx_garbage++;
+			continue;
 		}
-	} while(!stop);
 
-	if(q.size())
-		timeout_start();
+		pos += pkt_size(dlen);
+		on_packet(pkt[1], pkt[2], pkt + HEADER_SIZE, dlen);
+	}
+
+	// keep the start of an incomplete packet
+	std::copy(rx.begin() + pos, rx.begin() + rx_len, rx.begin());
+	rx_len -= pos;
 
 	recv_start();
 }
 
-void Driver::on_packet(u8 type, u8 value)
+void Driver::on_packet(u8 type, u8 seq, const u8* data, u8 len)
 {
-	timer.cancel();
-	timeout_num = 0;
+	if(type & STREAM_BIT)
+	{
+		on_stream(type & ~STREAM_BIT, seq, data, len);
+		return;
+	}
 
 	bool err = (type & ERR_BIT) > 0;
 	type &= ~ERR_BIT;
 
-	logger->trace("RX 0x{:02x} {:3x}", type, value);
+	logger->trace("RX 0x{:02x} #{:3} {:3x}", type, seq, len ? data[0] : 0);
 
-	if(type >= u8(Type::_MAX)) return;
+	if(type == Type::MOTOR)
+	{
+		// answers to superseded speeds don't matter
+		if(seq == speed_ctrl.seq && !speed_ctrl.acked)
+		{
+			speed_ctrl.acked = true;
+			link.types[Type::MOTOR].replies++;
+			link.types[Type::MOTOR].errors += err;
+			link.types[Type::MOTOR].add_rtt(steady_timer::clock_type::now() - speed_ctrl.sent);
+			if(err)
+				logger->error("motor speed {} rejected", speed_ctrl.curr);
+		}
+		return;
+	}
+
+	auto it = std::find_if(inflight.begin(), inflight.end(), [&](auto& r){ return r.busy && r.seq == seq; });
+	if(it == inflight.end() || it->type != type)
+	{
+		// late answer of a retransmitted request
+		logger->debug("unexpected reply 0x{:02x} #{}", type, seq);
+		return;
+	}
 
-	while(!q.empty())
+	if(type < Type::_MAX)
 	{
-		Req &r = q.front();
-		bool found = r.type == type;
-		if(found && r.cb)
+		auto &stat = link.types[type];
+		stat.replies++;
+		stat.errors += err;
+		// a retransmitted request may be answered by either copy, its time is ambiguous
+		if(it->tries == 1)
 		{
-			if(!err)
-				r.cb({}, value);
-			else
-				r.cb(std::make_error_code(std::errc::protocol_error), {});
+			const auto sample = steady_timer::clock_type::now() - it->sent;
+			stat.add_rtt(sample);
+			rtt_sample(type, sample, pings(*it));
 		}
+	}
+
+	Reply cb = std::move(it->cb);
+	*it = Req();
+	inflight_num--;
 
-		q.pop_front();
-		if(!found)
-			logger->warn("tx/rx async");
+	if(cb)
+	{
+		if(!err)
+			cb({}, data, len);
 		else
-			break;
+			cb(std::make_error_code(std::errc::protocol_error), nullptr, 0);
 	}
+
+	pump();
+	timeout_start();
 }
@@ -2,15 +2,73 @@
 
 #include "asio.hpp"
 #include "def.hpp"
+#include "handler_memory.hpp"
 #include "logger.hpp"
+#include "inplace_fn.hpp"
+#include "ring.hpp"
 #include "types.hpp"
 
-#include <boost/asio/buffers_iterator.hpp>
+#include "proto-def.hpp"
+
 #include <boost/asio/serial_port.hpp>
 #include <boost/asio/steady_timer.hpp>
-#include <boost/asio/streambuf.hpp>
 
-#include <deque>
+#include <array>
+#include <chrono>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Counters of the serial link since the start
+ */
+struct LinkStats
+{
+	/**
+	 * @brief Number of RTT histogram buckets, bucket i counts RTTs up to RTT_BUCKET_US << i, the last one all above
+	 */
+	static constexpr usz RTT_BUCKETS = 12;
+	static constexpr u32 RTT_BUCKET_US = 250;
+
+	/**
+	 * @brief Counters of one packet type
+	 */
+	struct Type
+	{
+		u32 sent = 0;        ///< requests sent the first time
+		u32 replies = 0;     ///< matched replies
+		u32 errors = 0;      ///< replies with the error bit
+		u32 retries = 0;     ///< retransmissions
+		u32 timeouts = 0;    ///< requests given up after all retries
+		u32 dropped = 0;     ///< requests dropped because the queue was full
+		u32 superseded = 0;  ///< values replaced before they were sent
+		u32 stream = 0;      ///< readings pushed by subscriptions
+		u32 stream_lost = 0; ///< readings missing in the sequence of a subscription
+		std::array<u32, RTT_BUCKETS> rtt {}; ///< send to reply histogram
+		f64 rtt_sum_ms = 0.0;
+		f32 rtt_max_ms = 0.0;
+		f32 srtt_ms = 0.0;   ///< smoothed RTT the timeout is derived from, of the last sampled class
+		f32 rto_ms = 0.0;    ///< retransmission timeout of the last sampled class
+
+		/**
+		 * @brief Add a round trip time sample
+		 */
+		void add_rtt(std::chrono::steady_clock::duration rtt);
+		/**
+		 * @return Upper bound of the bucket the p-th quantile falls in, in milliseconds
+		 */
+		f32 rtt_quantile(f32 p) const;
+	};
+
+	std::array<Type, proto::Type::_MAX> types;
+	u32 queue_max = 0;   ///< most requests waiting for the window at once
+	u32 rx_garbage = 0;  ///< received bytes that weren't part of a packet
+	u32 dropped = 0;     ///< requests of any type dropped because the queue was full
+
+	/**
+	 * @return All counters as JSON object
+	 */
+	std::string json() const;
+};
 
 /**
  * @brief Communication class with Driver component
@@ -22,6 +80,40 @@ struct Driver
 	 */
 	static const def::Scale limit;
 
+	/**
+	 * @brief Completion handler, stored inline without allocation
+	 *
+	 * Lambdas capturing more than a few pointers fail to compile.
+	 */
+	using Callback = InplaceFn<void(std::error_code, u8), 32>;
+
+	/**
+	 * @brief Distances of several ultra sonic sensors measured in one exchange
+	 */
+	struct Gaps
+	{
+		u16 pins = 0;  ///< bitmap of the measured pins
+		u8 count = 0;
+		std::array<u8, proto::MAX_DATA> mm {}; ///< distances in mm, lowest pin first
+
+		/**
+		 * @return Distance measured at pin, 255 if it wasn't part of the burst
+		 */
+		u8 at(u8 pin) const;
+	};
+	using GapsCallback = InplaceFn<void(std::error_code, const Gaps&), 32>;
+
+	/**
+	 * @brief Distance of an oversampled ultra sonic reading
+	 */
+	struct Gap
+	{
+		u8 mm = 0;      ///< median of all pings
+		u8 spread = 0;  ///< difference of the longest and shortest ping, 0 for a single one
+		u8 samples = 0; ///< number of pings
+	};
+	using GapCallback = InplaceFn<void(std::error_code, Gap), 32>;
+
 	/**
 	 * @param ctx        Managing io_context from Asio
 	 * @param dev_path   Device file of Driver (e.g. /dev/ttyACM0 for Arduino)
@@ -38,29 +130,135 @@ struct Driver
 	 * @param pin       Pin the sensors uses
 	 * @param callback  Function to call with gap distance in mm
 	 */
-	void gap(u8 pin, std::function<void(std::error_code, u8 mm)> callback);
+	void gap(u8 pin, Callback callback);
+	/**
+	 * @brief Query an ultra sonic sensor with several pings, the firmware returns their median
+	 * @param pin       Pin the sensors uses
+	 * @param samples   Number of pings, at most proto::MAX_SAMPLES
+	 * @param callback  Function to call with the distance and its spread
+	 */
+	void gap(u8 pin, u8 samples, GapCallback callback);
+	/**
+	 * @brief Query several ultra sonic sensors at once, the firmware pings them one after another
+	 * @param pins      Bitmap of the pins, at most proto::MAX_DATA bits set
+	 * @param callback  Function to call with all distances
+	 */
+	void gaps(u16 pins, GapsCallback callback);
 	/**
 	 * @brief Query analog pins
 	 * @param pin       Analog pin
 	 * @param callback  Function to call with voltage value
 	 */
-	void analog(u8 pin, std::function<void(std::error_code, u8 v)> callback);
+	void analog(u8 pin, Callback callback);
 	/**
 	 * @brief Query Driver firmware version
 	 * @param callback  Function to call with version
 	 */
-	void version(std::function<void(std::error_code, u8 ver)> callback);
+	void version(Callback callback);
+
+	/**
+	 * @brief Let the firmware measure the distance periodically and push the readings
+	 * @param pin       Pin the sensors uses
+	 * @param period    Time between two readings, at most 65535ms
+	 * @param callback  Function to call with every gap distance in mm, or the error if subscribing failed
+	 */
+	void gap_stream(u8 pin, std::chrono::milliseconds period, Callback callback);
+	/**
+	 * @brief Let the firmware measure the distance periodically with several pings
+	 * @param pin       Pin the sensors uses
+	 * @param period    Time between two readings, raised to fit all pings
+	 * @param samples   Pings per reading, at most proto::MAX_SAMPLES
+	 * @param callback  Function to call with every distance and its spread, or the error if subscribing failed
+	 */
+	void gap_stream(u8 pin, std::chrono::milliseconds period, u8 samples, GapCallback callback);
+	/**
+	 * @brief Let the firmware read an analog pin periodically and push the values
+	 * @param pin       Analog pin
+	 * @param period    Time between two readings, at most 65535ms
+	 * @param callback  Function to call with every voltage value, or the error if subscribing failed
+	 */
+	void analog_stream(u8 pin, std::chrono::milliseconds period, Callback callback);
+	/**
+	 * @brief Stop a stream started with gap_stream() or analog_stream()
+	 * @param kind  proto::Type::ULTRA_SONIC or proto::Type::ANALOG
+	 * @param pin   Pin of the stream
+	 */
+	void stop_stream(proto::Type kind, u8 pin);
+
+	/**
+	 * @return Link counters and latency histograms
+	 */
+	const LinkStats& stats() const { return link; }
+	/**
+	 * @return Number of requests waiting for the window
+	 */
+	usz queued() const { return q.size(); }
+	/**
+	 * @return Number of requests in flight
+	 */
+	usz in_flight() const { return inflight_num; }
 
 private:
-	using buffer_iter = buffers_iterator<const_buffers_1>;
+	/**
+	 * @brief Completion handler with the whole reply payload, which is only valid during the call
+	 *
+	 * Large enough to wrap one of the public callbacks.
+	 */
+	using Reply = InplaceFn<void(std::error_code, const u8* data, u8 len), 64>;
 
 	/**
 	 * @brief Common function for sending packets
 	 * @param type      Packet type
 	 * @param value     Payload
-	 * @param callback  Function to call with response
+	 * @param callback  Function to call with the first byte of the response
 	 */
-	void send(u8 type, u8 value, std::function<void(std::error_code, u8 cm)> callback = {});
+	void send(u8 type, u8 value, Callback callback = {});
+	/**
+	 * @overload void send(u8 type, u8 value, Callback callback)
+	 * @param data  Payload
+	 * @param len   Size of payload, at most proto::MAX_DATA
+	 */
+	void send(u8 type, const u8* data, u8 len, Callback callback = {});
+	/**
+	 * @overload void send(u8 type, const u8* data, u8 len, Callback callback)
+	 */
+	void send(u8 type, const u8* data, u8 len, Reply callback);
+	/**
+	 * @return Reply handler passing the first byte to callback
+	 */
+	static Reply value_reply(Callback callback);
+	/**
+	 * @return Reply handler passing an ultra sonic reading of samples pings to callback
+	 */
+	static Reply gap_reply(u8 samples, GapCallback callback);
+
+	/**
+	 * @brief Add or update a stream and send its subscription
+	 * @param callback  Called with the payload of every reading behind the pin
+	 */
+	void subscribe(u8 kind, u8 pin, std::chrono::milliseconds period, u8 samples, Reply callback);
+	/**
+	 * @brief Send the subscription request of a stream
+	 */
+	void subscribe_send(u8 kind, u8 pin, u16 period_ms, u8 samples);
+	/**
+	 * @brief Handle a reading pushed by the firmware
+	 * @param kind  Sensor type of the stream
+	 * @param seq   Sample number within the stream
+	 * @param data  Pin and value
+	 * @param len   Size of data
+	 */
+	void on_stream(u8 kind, u8 seq, const u8* data, u8 len);
+	/**
+	 * @brief Resubscribe streams that went silent, e.g. after a firmware reset
+	 * @param ec   Possible i/o error
+	 */
+	void stream_check(std::error_code ec);
+
+	/**
+	 * @brief Move queued requests into the window of requests in flight
+	 */
+	void pump();
 
 	/**
 	 * @brief Initiate packet send
@@ -85,46 +283,158 @@ private:
 	void recv_handle(std::error_code ec, usz len);
 
 	/**
-	 * @brief Start timeout timer
+	 * @brief Retransmission timeout of a request class, like TCP (RFC 6298)
+	 *
+	 * A class is a packet type and the number of ultra sonic pings, requests
+	 * of one class take the same service time in the firmware.
+	 */
+	struct RttEstimator
+	{
+		steady_timer::duration srtt {}, rttvar {};
+		bool valid = false;
+	};
+
+	/**
+	 * @brief Update the RTT estimate of a request class with an unambiguous sample
+	 * @param pings  Ultra sonic pings of the sampled request
+	 */
+	void rtt_sample(u8 type, steady_timer::duration rtt, u8 pings);
+	/**
+	 * @return Timeout for the first transmission of a request of this class
+	 * @param pings  Ultra sonic pings the firmware does before it answers
+	 */
+	steady_timer::duration rto(u8 type, u8 pings) const;
+
+	/**
+	 * @brief Fail all requests in flight
+	 * @param ec  Error passed to their callbacks
+	 */
+	void fail_inflight(std::error_code ec);
+
+	/**
+	 * @brief Start timeout timer for the earliest deadline in flight
 	 */
 	void timeout_start();
 	/**
-	 * @brief Handle timeout
+	 * @brief Handle timeout, retransmit or fail expired requests
 	 */
 	void timeout_handle();
 
 	/**
 	 * @brief Handle confirmed packets
-	 * @param type   Packet type
-	 * @param value  Payload
+	 * @param type  Packet type
+	 * @param seq   Sequence number of the request
+	 * @param data  Payload
+	 * @param len   Size of payload
 	 */
-	void on_packet(u8 type, u8 value);
+	void on_packet(u8 type, u8 seq, const u8* data, u8 len);
 	/**
 	 * @brief Timed callback to feed speed values to Driver and delay watchdog
 	 * @param ec   Possible i/o error
 	 */
 	void wd_feed(std::error_code ec);
+	/**
+	 * @brief Put the current speed into the motor slot
+	 *
+	 * The slot is sent ahead of all other packets with the next write. A speed
+	 * that is replaced before the write starts is never sent.
+	 */
+	void motor_send();
+
+	/**
+	 * @brief Number of requests in flight
+	 */
+	static constexpr usz WINDOW = 8;
+	/**
+	 * @brief Number of requests waiting for the window before new ones are dropped
+	 */
+	static constexpr usz QUEUE_MAX = 16;
+	/**
+	 * @brief Transmit buffer size, every request in flight fits once
+	 */
+	static constexpr usz TX_SIZE = WINDOW * proto::PKT_MAX;
+	/**
+	 * @brief Size of a motor packet, always kept free in the transmit buffer
+	 */
+	static constexpr usz MOTOR_SIZE = proto::pkt_size(1);
+	/**
+	 * @brief Receive buffer size
+	 */
+	static constexpr usz RX_SIZE = 4 * proto::PKT_MAX;
+
+	struct Req
+	{
+		u8 type = 0;
+		u8 seq = 0;
+		u8 len = 0;
+		std::array<u8, proto::MAX_DATA> data {};
+		Reply cb;
+		steady_timer::time_point sent;
+		steady_timer::time_point deadline;
+		steady_timer::duration rto {};  ///< timeout of the last transmission
+		u8 tries = 0;
+		bool busy = false; ///< slot of the window is in use
+	};
+
+	/**
+	 * @return Number of ultra sonic pings the firmware does for the request
+	 */
+	static u8 pings(const Req& r);
+
+	/**
+	 * @brief Append a request packet to the transmit buffer and restart its timeout
+	 * @note A packet that doesn't fit is retransmitted after the timeout.
+	 */
+	void transmit(Req& r);
 
 	loggr logger;
+	HandlerMemory handlers; ///< every pending operation of the link, outlives them
 	serial_port dev;
-	streambuf buf_r, buf_w;
+	std::array<u8, RX_SIZE> rx;
+	usz rx_len = 0;
+	/**
+	 * @brief Double buffered transmit, packets go to next while busy is written
+	 */
+	struct TxBuf
+	{
+		std::array<u8, TX_SIZE + MOTOR_SIZE> data;
+		usz len = 0;
+	} tx[2];
+	TxBuf *tx_next = &tx[0], *tx_busy = &tx[1];
 	steady_timer timer;
-	u8 timeout_num;
+	steady_timer::time_point timer_due; ///< expiry of the running wait
+	bool timer_armed = false;
+	u8 seq_next;
 
-	enum ParseState
-	{
-		SYNC, DATA
-	} parse_state;
+	Ring<Req, QUEUE_MAX> q;             ///< waiting for a free slot in the window
+	std::array<Req, WINDOW> inflight;   ///< sent, waiting for their reply
+	usz inflight_num = 0;
 
-	struct Req
+	struct Stream
 	{
-		u8 type;
-		std::function<void(std::error_code, u8 cm)> cb;
+		u8 kind;
+		u8 pin;
+		u16 period_ms;
+		u8 samples;   ///< pings per reading
+		Reply cb;
+		u8 seq;       ///< expected sample number
+		steady_timer::time_point last;
 	};
-	std::deque<Req> q;
+	std::vector<Stream> streams;
+	steady_timer stream_timer;
+
+	LinkStats link;
+	u32 drops_logged = 0;  ///< link.dropped at the last warning
+	steady_timer::time_point drop_warned;
+	std::array<std::array<RttEstimator, proto::MAX_SAMPLES + 1>, proto::Type::_MAX> rtt;
 
 	struct {
 		steady_timer feeder;
 		u8 curr;
+		u8 seq;         ///< sequence number of the newest motor packet
+		bool staged;    ///< motor packet waits at the start of tx_next
+		bool acked;     ///< newest motor packet was answered
+		bool feeding;   ///< feeder runs
+		steady_timer::time_point sent;
 	} speed_ctrl;
 };
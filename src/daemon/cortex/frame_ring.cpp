@@ -0,0 +1,95 @@
+#include "frame_ring.hpp"
+
+cv::Mat* FrameRing::claim()
+{
+	const i32 skip = newest.load(std::memory_order_acquire);
+
+	// take the oldest slot nobody reads from
+	i32 pick = -1;
+	for(i32 i = 0; i < i32(SLOTS); i++)
+	{
+		if(i == skip || slots[i].state.load(std::memory_order_relaxed) != 0)
+			continue;
+		if(pick < 0 || slots[i].frame.seq < slots[pick].frame.seq)
+			pick = i;
+	}
+
+	if(pick < 0)
+		return nullptr;
+
+	i32 idle = 0;
+	if(!slots[pick].state.compare_exchange_strong(idle, -1, std::memory_order_acquire))
+		return nullptr; // a reader was faster, skip this frame
+
+	writing = pick;
+	return &slots[pick].frame.image;
+}
+
+void FrameRing::commit(clock::time_point time)
+{
+	Slot& slot = slots[writing];
+	slot.frame.time = time;
+	slot.frame.seq = seq.load(std::memory_order_relaxed) + 1;
+	slot.state.store(0, std::memory_order_release);
+
+	newest.store(writing, std::memory_order_release);
+	seq.store(slot.frame.seq, std::memory_order_release);
+	writing = -1;
+
+	// the lock only orders the notification against a reader going to sleep
+	{ std::lock_guard<std::mutex> lock(wait_mtx); }
+	wait_cv.notify_all();
+}
+
+void FrameRing::abort()
+{
+	slots[writing].state.store(0, std::memory_order_release);
+	writing = -1;
+}
+
+bool FrameRing::read(Frame& out, u64 after)
+{
+	for(;;)
+	{
+		const i32 i = newest.load(std::memory_order_acquire);
+		if(i < 0)
+			return false;
+
+		Slot& slot = slots[i];
+		i32 readers = slot.state.load(std::memory_order_acquire);
+		if(readers < 0)
+			continue; // slot is being reused, so a newer one is already published
+		if(!slot.state.compare_exchange_weak(readers, readers + 1, std::memory_order_acq_rel))
+			continue;
+
+		const bool fresh = slot.frame.seq > after;
+		if(fresh)
+		{
+			slot.frame.image.copyTo(out.image);
+			out.time = slot.frame.time;
+			out.seq = slot.frame.seq;
+		}
+
+		slot.state.fetch_sub(1, std::memory_order_release);
+		return fresh;
+	}
+}
+
+bool FrameRing::wait(Frame& out, u64 after, clock::duration timeout)
+{
+	const auto deadline = clock::now() + timeout;
+	while(!read(out, after))
+	{
+		std::unique_lock<std::mutex> lock(wait_mtx);
+		if(latest() > after)
+			continue;
+		if(wait_cv.wait_until(lock, deadline) == std::cv_status::timeout)
+			return read(out, after);
+	}
+	return true;
+}
+
+u64 FrameRing::latest() const
+{
+	return seq.load(std::memory_order_acquire);
+}
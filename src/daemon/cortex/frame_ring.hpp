@@ -0,0 +1,91 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+/**
+ * @brief Lock-free ring of the most recent camera frames
+ *
+ * One capture thread writes frames into free slots while any number of vision
+ * threads copy out the newest one. Slots are claimed with an atomic state
+ * instead of a lock, so neither side ever waits for the other one to finish.
+ */
+struct FrameRing
+{
+	using clock = std::chrono::steady_clock;
+
+	/**
+	 * @brief A captured image with its capture time
+	 */
+	struct Frame
+	{
+		cv::Mat image;
+		clock::time_point time;  ///< Time the frame was grabbed from the device
+		u64 seq = 0;             ///< Running frame number, 0 if no frame was read yet
+	};
+
+	/**
+	 * @brief Claim a free slot to write the next frame into
+	 * @return Image buffer of the slot or nullptr if all slots are in use
+	 * @note Writer side only. Must be followed by commit() or abort().
+	 */
+	cv::Mat* claim();
+	/**
+	 * @brief Publish the claimed slot as the newest frame
+	 * @param time  Capture time of the frame
+	 */
+	void commit(clock::time_point time);
+	/**
+	 * @brief Release the claimed slot without publishing it
+	 */
+	void abort();
+
+	/**
+	 * @brief Copy the newest frame
+	 * @param out    Frame to copy into. Its image buffer is reused if possible.
+	 * @param after  Only return frames newer than this sequence number
+	 * @return true if a frame was copied
+	 */
+	bool read(Frame& out, u64 after = 0);
+	/**
+	 * @brief Wait for a frame newer than after and copy it
+	 * @param out      Frame to copy into
+	 * @param after    Sequence number of the last seen frame
+	 * @param timeout  Maximum duration to wait
+	 * @return true if a frame was copied
+	 */
+	bool wait(Frame& out, u64 after, clock::duration timeout);
+
+	/**
+	 * @return Sequence number of the newest frame
+	 */
+	u64 latest() const;
+
+private:
+	static constexpr usz SLOTS = 4;
+
+	struct Slot
+	{
+		Frame frame;
+		/**
+		 * @brief -1 while written, otherwise number of readers
+		 */
+		std::atomic<i32> state {0};
+	};
+
+	std::array<Slot, SLOTS> slots;
+	std::atomic<i32> newest {-1};
+	std::atomic<u64> seq {0};
+	i32 writing = -1;
+
+	// only used to sleep while no new frame is available
+	std::mutex wait_mtx;
+	std::condition_variable wait_cv;
+};
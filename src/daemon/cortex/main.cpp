@@ -1,7 +1,9 @@
 
 #include "asio.hpp"
+#include "control.hpp"
 #include "def.hpp"
 #include "echo.hpp"
+#include "multicast.hpp"
 #include "logger.hpp"
 #include "net.hpp"
 #include "opts.hpp"
@@ -14,9 +16,12 @@
 #include "driver.hpp"
 #include "pwm.hpp"
 
+#include <boost/asio/post.hpp>
 #include <boost/asio/steady_timer.hpp>
 #include <boost/asio/signal_set.hpp>
 
+#include <cstdio>
+
 /* slave
  * mqtt -> driver, steering
 */
@@ -42,11 +47,23 @@ struct
 	CommonOpts common;
 	bool is_slave;
 	u32 gap_test = 0;
+	u32 gap_samples = 3;
+	u32 gap_rate_ms = 0;   // least time between two sp/gap messages, 0 publishes every reading
+	u32 gap_deadband = 0;  // hold back sp/gap changes smaller than this in mm
+	std::string driver_path = "/dev/ttyACM0";
+	u32 telemetry_ms = 1000;
+	std::string control = "both"; // accepted control topics: binary, text or both
 	struct {
-		i32 update_interval_ms = 100;
+		i32 max_age_ms = 100;
 		std::string pattern_path = "pattern.png";
 		u32 width = 320, height = 240;
 		f32 match_value = 0.6;
+		bool pyramid = false;
+		bool color = false;
+		i32 threads = 1;
+		f32 budget_ms = 0;
+		bool barcode = false;
+		std::string barcode_roi;
 	} cam;
 } conf;
 
@@ -64,19 +81,37 @@ int main(int argc, const char* argv[])
 
 	conf.is_slave = opts["-S"];
 	opts({"-g", "--gap"}, conf.gap_test) >> conf.gap_test;
-	opts({"--cam-interval"}, conf.cam.update_interval_ms) >> conf.cam.update_interval_ms;
+	opts({"--gap-samples"}, conf.gap_samples) >> conf.gap_samples;
+	opts({"--gap-rate"}, conf.gap_rate_ms) >> conf.gap_rate_ms;
+	opts({"--gap-deadband"}, conf.gap_deadband) >> conf.gap_deadband;
+	opts({"--driver"}, conf.driver_path) >> conf.driver_path;
+	opts({"--telemetry"}, conf.telemetry_ms) >> conf.telemetry_ms;
+	opts({"--control"}, conf.control) >> conf.control;
+	opts({"--cam-max-age"}, conf.cam.max_age_ms) >> conf.cam.max_age_ms;
 	opts({"--cam-pattern"}, conf.cam.pattern_path) >> conf.cam.pattern_path;
 	opts({"--cam-match-val"}, conf.cam.match_value) >> conf.cam.match_value;
+	conf.cam.pyramid = opts["--cam-pyramid"];
+	conf.cam.color = opts["--cam-color"];
+	opts({"--cam-threads"}, conf.cam.threads) >> conf.cam.threads;
+	opts({"--cam-budget"}, conf.cam.budget_ms) >> conf.cam.budget_ms;
+	conf.cam.barcode = opts["--cam-barcode"];
+	opts({"--cam-barcode-roi"}, conf.cam.barcode_roi) >> conf.cam.barcode_roi;
 
 	// let's go!
 	logger = new_loggr("cortex");
 	logger->info("sp-cortex v0.1");
 
+	if(conf.control != "binary" && conf.control != "text" && conf.control != "both")
+	{
+		logger->error("unknown control mode {}, use binary, text or both", conf.control);
+		return 1;
+	}
+
 	io_context ioctx;
 
 	logger->info("initialising hardware...");
 
-	auto driver = try_init<Driver>("driver", ioctx, "/dev/ttyACM0");
+	auto driver = try_init<Driver>("driver", ioctx, conf.driver_path.c_str());
 	auto steering = try_init<Steering>("steering");
 
 	// hardcoded test scenario
@@ -89,13 +124,27 @@ int main(int argc, const char* argv[])
 
 	logger->info("connecting with id {} to {}:{}", conf.common.name, conf.common.host, conf.common.port);
 	MQTTClient cl(ioctx, conf.common.host, conf.common.port, conf.common.name);
+	// no handshakes for values that are replaced right away
+	for(auto topic: { def::CONTROL_SUB, def::MOTOR_SUB, def::STEER_SUB, def::GAP_SUB })
+		cl.set_profile(topic, MQTTClient::Profile::CONTROL);
+	cl.set_profile(fmt::format("{}#", def::TELEMETRY_SUB), MQTTClient::Profile::CONTROL);
+	cl.set_profile(def::BARCODE_SUB, MQTTClient::Profile::EVENT);
+	if(conf.gap_rate_ms || conf.gap_deadband)
+	{
+		MQTTClient::Policy gap;
+		gap.interval = std::chrono::milliseconds(conf.gap_rate_ms);
+		gap.deadband = conf.gap_deadband;
+		cl.set_policy(def::GAP_SUB, gap);
+	}
 	cl.connect();
 
 	// camera data
 	struct {
 		std::unique_ptr<SyncCamera> driver;
 		std::thread thread;
-		std::atomic<int> value;
+		std::atomic<bool> pending {false};
+		u64 seq = 0;
+		u32 results = 0;
 		int center = 0, align = 0;
 	} cam;
 
@@ -109,23 +158,47 @@ int main(int argc, const char* argv[])
 		{
 			// then initialize hardware
 			cam.driver = try_init<SyncCamera>("camera", "/dev/video0", conf.cam.pattern_path);
+			// a camera that can't take the resolution is left out, like one that failed to open
+			try {
+				if(cam.driver)
+					cam.driver->set_resolution(conf.cam.width, conf.cam.height);
+			} catch(std::runtime_error& ex)
+			{
+				logger->error("failed to set camera resolution {}x{}: {}", conf.cam.width, conf.cam.height, ex.what());
+				cam.driver.reset();
+			}
 			if(cam.driver)
 			{
-				cam.driver->set_resolution(conf.cam.width, conf.cam.height);
 				cam.driver->set_matchval(conf.cam.match_value);
-				cam.thread = std::thread([&](auto *atom){ cam.driver->start_sync_camera(atom); }, &cam.value);
+				if(conf.cam.pyramid)
+					cam.driver->set_search_mode(SyncCamera::SearchMode::Pyramid);
+				cam.driver->set_match_threads(conf.cam.threads);
+				cam.driver->set_track_budget(conf.cam.budget_ms);
+				if(conf.cam.color)
+					cam.driver->set_color_mode(SyncCamera::ColorMode::Color);
+				// apply each new camera result once on the event loop
+				auto cam_handle = [&]
+				{
+					cam.pending = false;
 
-				logger->info("cam {} initialized", 0);
+					CamResult res = cam.driver->get_result();
+					if(res.seq <= cam.seq)
+						return;
+					cam.seq = res.seq;
 
-				cam.value.store(0);
+					// a loss after a camera stall comes with the last frame, it applies anyway
+					auto age = std::chrono::steady_clock::now() - res.time;
+					if(res.x >= 0 && age > std::chrono::milliseconds(conf.cam.max_age_ms))
+					{
+						logger->debug("CAM result of frame {} too old: {}ms", res.frame,
+						              std::chrono::duration_cast<std::chrono::milliseconds>(age).count());
+						return;
+					}
 
-				// check the offset in intervals
-				auto cam_timer = std::make_shared<Timer>(ioctx);
-				cam_timer->start(std::chrono::milliseconds(conf.cam.update_interval_ms), [&, cam_timer](auto ec)
-				{
-					if(ec) return;
+					if(++cam.results % 100 == 0)
+						logger->info("CAM frame time: {:.1f}ms at scale {:.2f}", res.frame_ms, res.scale);
 
-					auto align = cam.value.load();
+					auto align = res.x;
 					if(cam.center==0 && align>0) {
 						cam.center = align;
 						logger->info("CAM initialized to: {}",cam.center);
@@ -137,80 +210,165 @@ int main(int argc, const char* argv[])
 						cam.center=0;
 						logger->debug("CAM pattern lost, err: {}", align);
 					}
+				};
+				cam.driver->on_result([&, cam_handle]
+				{
+					// the camera thread may be faster than the loop, one pending wakeup is enough
+					if(!cam.pending.exchange(true))
+						post(ioctx, cam_handle);
 				});
+				cam.thread = std::thread([&]{ cam.driver->start_sync_camera(); });
+
+				if(conf.cam.barcode)
+				{
+					// x,y,width,height in frame pixels
+					cv::Rect roi;
+					if(!conf.cam.barcode_roi.empty() &&
+					   4 != std::sscanf(conf.cam.barcode_roi.c_str(), "%d,%d,%d,%d", &roi.x, &roi.y, &roi.width, &roi.height))
+					{
+						logger->error("invalid barcode roi {}, scanning full frame", conf.cam.barcode_roi);
+						roi = cv::Rect();
+					}
+					cam.driver->set_barcode_roi(roi);
+
+					cam.driver->start_barcode_scan([&](long barcode)
+					{
+						post(ioctx, [&, barcode]
+						{
+							logger->info("CAM barcode: {}", barcode);
+							cl.publish(def::BARCODE_SUB, fmt::format("{}", barcode));
+						});
+					});
+				}
+
+				logger->info("cam {} initialized", 0);
 			}
 		}
 
 		if(driver && conf.gap_test == 0)
 		{
-			// start gap updater
-			auto gap_timer = std::make_shared<Timer>(ioctx);
-			gap_timer->start(std::chrono::milliseconds(50), [&, gap_timer](auto ec)
+			// let the firmware push distances, median of several pings each
+			driver->gap_stream(7, std::chrono::milliseconds(50), u8(conf.gap_samples), [&](auto ec, Driver::Gap gap)
 			{
-				if(ec) return;
-
-				static u8 pin = 7, i = 0, init = 0;
-				static std::array<u8, 3> values;
-
-				driver->gap(pin, [&](auto ec, u8 mm)
+				if(ec)
 				{
-					if(ec)
-					{
-						on_change(ec, [&](auto, auto ec)
-						{
-							logger->debug("GAP ERR {} ", ec.message());
-						});
-						return;
-					}
+					logger->error("GAP stream failed: {}", ec.message());
+					return;
+				}
 
-					if(!init) {
-						values.fill(mm);
-						init = 1;
-					} else
-					{
-						values[i] = mm;
-						if(++i == values.size())
-							i = 0;
-
-						// get median of low pass
-						auto a = values;
-						std::sort(a.begin(), a.end());
-						mm = a[a.size()/2];
-					}
-
-					adj.gap_update(mm);
-					cl.publish("sp/gap", fmt::format("{}", mm));
-				});
+				logger->trace("GAP {}mm spread {}mm", gap.mm, gap.spread);
+				adj.gap_update(gap.mm);
+				cl.publish(def::GAP_SUB, fmt::format("{}", gap.mm));
 			});
 		}
 	}
 
-	cl.subscribe("sp/gap", [&](const std::string& str)
+	cl.subscribe(def::GAP_SUB, [&](const std::string& str)
 	{
 		i32 mm = std::atoi(str.c_str());
 		if(!adj.gap)
 			adj.gap_inner(mm);
 	});
 
-	// receive speed input
-	cl.subscribe(def::MOTOR_SUB, [&](const std::string& str)
+	// map network speed to ours
+	auto speed_in = [&](i32 value)
 	{
-		// map network speed to ours
-		auto speed = map_dual(std::atoi(str.c_str()),
+		auto speed = map_dual(value,
 		                      def::MOTOR_SCALE.min, def::MOTOR_SCALE.max,
 		                      Driver::limit.min, Driver::limit.max);
 		adj.speed_update(speed);
-	});
+	};
 
-	// ...and steer input
-	cl.subscribe(def::STEER_SUB, [&](const std::string& str)
+	// ...and the steer degree
+	auto steer_in = [&](i32 value)
 	{
-		// map network degree to ours
-		auto deg = map(std::atoi(str.c_str()),
+		auto deg = map(value,
 		               def::STEER_SCALE.min, def::STEER_SCALE.max,
 		               Steering::limit.min, Steering::limit.max);
 		adj.steer_update(deg);
-	});
+	};
+
+	// receive speed and steer input in one message, without reordering
+	ControlFilter control_filter;
+	auto control_in = [&](const Control& ctl, const char* via)
+	{
+		// the same message may arrive via MQTT and multicast, the first one wins
+		if(!control_filter.accept(ctl))
+		{
+			logger->trace("CONTROL: dropping stale #{} via {}, applied #{} ({} so far)", ctl.seq, via, control_filter.last(), control_filter.stale);
+			return;
+		}
+
+		logger->trace("CONTROL: #{} {} {} via {} ({}us old)", ctl.seq, ctl.speed, ctl.steer, via, i64(Control::now_us() - ctl.time_us));
+		speed_in(ctl.speed);
+		steer_in(ctl.steer);
+	};
+
+	if(conf.control != "text")
+	{
+		cl.subscribe(def::CONTROL_SUB, [&](const std::string& payload)
+		{
+			Control ctl;
+			if(!ctl.decode(payload))
+			{
+				logger->warn("CONTROL: dropping payload of {} bytes", payload.size());
+				return;
+			}
+			control_in(ctl, "mqtt");
+		});
+	}
+
+	// ...and straight from the controller, without the broker in between
+	std::unique_ptr<ControlCast> cast;
+	if(conf.common.multicast.enabled)
+	{
+		const auto &mc = conf.common.multicast;
+		cast = try_init<ControlCast>("multicast", ioctx, mc.group, mc.port, mc.iface);
+		try {
+			if(cast)
+				cast->listen([&](const Control& ctl){ control_in(ctl, "multicast"); });
+		} catch(std::runtime_error& ex)
+		{
+			logger->error("failed to join {}:{}: {}", mc.group, mc.port, ex.what());
+			cast.reset();
+		}
+	}
+
+	// ...or as text on a topic each, for older controllers
+	if(conf.control != "binary")
+	{
+		cl.subscribe(def::MOTOR_SUB, [&](const std::string& str){ speed_in(std::atoi(str.c_str())); });
+		cl.subscribe(def::STEER_SUB, [&](const std::string& str){ steer_in(std::atoi(str.c_str())); });
+	}
+
+	// serial link counters, on request and periodically for comparing cars
+	auto link_report = [&]
+	{
+		return fmt::format("{{\"queued\":{},\"in_flight\":{},\"link\":{},\"multicast\":{}}}",
+		                   driver->queued(), driver->in_flight(), driver->stats().json(),
+		                   cast ? cast->stats().json() : "null");
+	};
+
+	Timer telemetry(ioctx);
+	if(driver && conf.telemetry_ms)
+	{
+		const auto topic = fmt::format("{}{}", def::TELEMETRY_SUB, conf.common.name);
+		telemetry.start(std::chrono::milliseconds(conf.telemetry_ms), [&, topic](auto ec)
+		{
+			if(ec) return;
+			cl.publish(topic, link_report());
+		});
+	}
+
+	signal_set dump(ioctx, SIGUSR1);
+	std::function<void(std::error_code, int)> on_dump = [&](auto ec, int)
+	{
+		if(ec) return;
+		if(driver)
+			logger->info("link: {}", link_report());
+		dump.async_wait(on_dump);
+	};
+	dump.async_wait(on_dump);
 
 	// in case the daemon needs to be found on a convoluted network
 	std::shared_ptr<Echo> echo;
@@ -0,0 +1,351 @@
+
+#include "logger.hpp"
+#include "types.hpp"
+
+#include "camera_opencv.hpp"
+
+#include <argh.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <unordered_map>
+
+/* offline benchmark
+ * recorded video -> SyncCamera stages
+*/
+
+using bench_clock = std::chrono::steady_clock;
+
+struct
+{
+	std::string input;
+	std::string pattern_path = "pattern.png";
+	std::string method = "sqdiff";
+	std::string tracker = "KCF";
+	std::string json_path;
+	u32 frames = 0;
+	u32 width = 320, height = 240;
+	f32 match_value = 0.6;
+	i32 iterations = 20;
+	i32 threads = 1;
+	i32 reacquire = 4;
+	f32 budget_ms = 0;
+	bool pyramid = false;
+	bool color = false;
+	bool compare = false;
+} conf;
+
+static const std::unordered_map<std::string, int> match_methods
+{
+	{ "sqdiff", CV_TM_SQDIFF_NORMED },
+	{ "ccorr",  CV_TM_CCORR_NORMED },
+	{ "ccoeff", CV_TM_CCOEFF_NORMED },
+};
+
+loggr logger;
+
+inline f64 percentile(std::vector<f64> v, f64 p)
+{
+	if(v.empty()) return 0.0;
+	std::sort(v.begin(), v.end());
+	return v[usz(p * (v.size() - 1))];
+}
+
+inline f64 mean(const std::vector<f64>& v)
+{
+	f64 sum = 0.0;
+	for(f64 x: v) sum += x;
+	return v.empty() ? 0.0 : sum / v.size();
+}
+
+// string as JSON string contents, paths and names come from the command line
+inline std::string json_escape(const std::string& str)
+{
+	std::string out;
+	for(char c: str)
+	{
+		if(c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if(u8(c) < 0x20)
+			out += fmt::format("\\u{:04x}", u8(c));
+		else
+			out += c;
+	}
+	return out;
+}
+
+/**
+ * @brief Measures the duration of a call in milliseconds
+ */
+template<class Fn>
+inline auto timed(std::vector<f64>& ms, Fn fn)
+{
+	auto start = bench_clock::now();
+	auto ret = fn();
+	ms.push_back(std::chrono::duration<f64, std::milli>(bench_clock::now() - start).count());
+	return ret;
+}
+
+/**
+ * @brief Latencies of one pipeline stage
+ */
+struct Stage
+{
+	const char* name;
+	std::vector<f64> ms;
+};
+
+/**
+ * @brief Replays the recording through the same stages start_sync_camera() runs
+ * @return exit code
+ */
+int replay(SyncCamera& cam, FrameSource& source, int method)
+{
+	Stage search {"search", {}}, reacquire {"reacquire", {}}, init {"init", {}}, track {"track", {}};
+
+	struct {
+		u32 frames = 0, tracked = 0, losses = 0;
+		u32 run = 0, longest = 0;
+		i64 first = -1;
+		std::vector<f64> recovery; // frames from loss to tracking again
+	} cont;
+
+	bool tracking = false, lost = false;
+	i32 attempt = 0;
+	u32 lost_at = 0;
+
+	cv::Mat view, image;
+	FrameSource::clock::time_point time;
+	for(; (!conf.frames || cont.frames < conf.frames) && source.acquire(view, time); cont.frames++)
+	{
+		cam.convert_frame(view, image); // done by the capture thread on a car
+		source.release();
+
+		if(tracking)
+		{
+			int x = timed(track.ms, [&]{ return cam.track_next(image); });
+			if(x >= 0)
+			{
+				cont.tracked++;
+				cont.longest = std::max(cont.longest, ++cont.run);
+				continue;
+			}
+
+			tracking = false;
+			lost = true;
+			attempt = 0;
+			lost_at = cont.frames;
+			cont.losses++;
+			cont.run = 0;
+			continue;
+		}
+
+		f64 val;
+		if(lost && attempt < conf.reacquire)
+			val = timed(reacquire.ms, [&]{ return cam.reacquire(image, method, attempt++, conf.iterations); });
+		else
+			val = timed(search.ms, [&]{ return cam.pattern_matching_scaled(image, method, conf.iterations); });
+
+		if(val <= 0)
+			continue;
+
+		if(0> timed(init.ms, [&]{ return cam.initialize_tracker(image, conf.tracker); }))
+		{
+			logger->error("unknown tracker type {}", conf.tracker);
+			return 1;
+		}
+
+		tracking = true;
+		if(cont.first < 0)
+			cont.first = cont.frames;
+		if(lost)
+			cont.recovery.push_back(cont.frames - lost_at);
+		lost = false;
+	}
+
+	const std::vector<const Stage*> stages { &search, &reacquire, &init, &track };
+
+	f64 busy = 0.0;
+	for(auto stage: stages)
+		for(f64 ms: stage->ms) busy += ms;
+	const f64 fps = busy > 0 ? cont.frames / (busy / 1000.0) : 0.0;
+	const f64 continuity = cont.frames ? f64(cont.tracked) / cont.frames : 0.0;
+
+	fmt::print("{:<10} {:>6} {:>8} {:>8} {:>8} {:>8} {:>8}\n", "stage", "calls", "mean ms", "p50 ms", "p95 ms", "p99 ms", "max ms");
+	for(auto stage: stages)
+		fmt::print("{:<10} {:6} {:8.2f} {:8.2f} {:8.2f} {:8.2f} {:8.2f}\n", stage->name, stage->ms.size(),
+		           mean(stage->ms), percentile(stage->ms, 0.5), percentile(stage->ms, 0.95),
+		           percentile(stage->ms, 0.99), percentile(stage->ms, 1.0));
+
+	if(conf.budget_ms > 0)
+		fmt::print("track budget: {:.1f}ms  achieved: {:.2f}ms  scale: {:.2f}\n",
+		           conf.budget_ms, cam.get_track_time(), cam.get_track_scale());
+	fmt::print("frames: {}  fps: {:.1f}  tracked: {:.1f}%  first match: {}  losses: {}  longest run: {}  recovery mean/max: {:.1f}/{:.0f} frames\n",
+	           cont.frames, fps, continuity * 100, cont.first, cont.losses, cont.longest,
+	           mean(cont.recovery), percentile(cont.recovery, 1.0));
+
+	if(conf.json_path.empty())
+		return 0;
+
+	std::ofstream json(conf.json_path);
+	if(!json)
+	{
+		logger->error("failed to write {}", conf.json_path);
+		return 1;
+	}
+
+	json << fmt::format("{{\"input\":\"{}\",\"width\":{},\"height\":{},\"method\":\"{}\",\"tracker\":\"{}\","
+	                    "\"search\":\"{}\",\"threads\":{},\"color\":{},\"budget_ms\":{},",
+	                    json_escape(conf.input), conf.width, conf.height, json_escape(conf.method), json_escape(conf.tracker),
+	                    conf.pyramid ? "pyramid" : "exhaustive", conf.threads, conf.color, conf.budget_ms);
+	json << "\"stages\":{";
+	for(usz i = 0; i < stages.size(); i++)
+	{
+		const auto& ms = stages[i]->ms;
+		json << fmt::format("{}\"{}\":{{\"calls\":{},\"mean_ms\":{:.3f},\"p50_ms\":{:.3f},\"p95_ms\":{:.3f},\"p99_ms\":{:.3f},\"max_ms\":{:.3f}}}",
+		                    i ? "," : "", stages[i]->name, ms.size(), mean(ms), percentile(ms, 0.5),
+		                    percentile(ms, 0.95), percentile(ms, 0.99), percentile(ms, 1.0));
+	}
+	json << "},";
+	json << fmt::format("\"frames\":{},\"fps\":{:.2f},\"continuity\":{:.4f},\"first_match\":{},\"losses\":{},"
+	                    "\"longest_run\":{},\"recovery_mean\":{:.2f},\"recovery_max\":{:.0f}}}\n",
+	                    cont.frames, fps, continuity, cont.first, cont.losses, cont.longest,
+	                    mean(cont.recovery), percentile(cont.recovery, 1.0));
+	return 0;
+}
+
+/**
+ * @brief Timing and result of one search strategy over all frames
+ */
+struct Run
+{
+	SyncCamera::SearchMode mode;
+	i32 threads;
+	const char* name;
+	std::vector<f64> ms;
+	std::vector<cv::Rect2d> found; ///< empty rectangle if nothing was found
+};
+
+/**
+ * @brief Runs the search strategies of pattern_matching_scaled() on the same frames
+ * @return exit code
+ */
+int compare(SyncCamera& cam, FrameSource& source, int method)
+{
+	std::vector<Run> runs
+	{
+		{ SyncCamera::SearchMode::Exhaustive, 1,            "exhaustive", {}, {} },
+		{ SyncCamera::SearchMode::Exhaustive, conf.threads, "parallel",   {}, {} },
+		{ SyncCamera::SearchMode::Pyramid,    1,            "pyramid",    {}, {} },
+	};
+
+	cv::Mat view, image;
+	FrameSource::clock::time_point time;
+	for(u32 n = 0; (!conf.frames || n < conf.frames) && source.acquire(view, time); n++)
+	{
+		for(Run& run: runs)
+		{
+			cam.set_search_mode(run.mode);
+			cam.set_match_threads(run.threads);
+			cam.convert_frame(view, image); // done by the capture thread on a car
+
+			f64 val = timed(run.ms, [&]{ return cam.pattern_matching_scaled(image, method, conf.iterations); });
+			run.found.push_back(val > 0 ? cam.get_tracking_rectangle() : cv::Rect2d());
+		}
+		source.release();
+	}
+
+	fmt::print("{:<12} {:>8} {:>8} {:>8} {:>8} {:>7}\n", "mode", "mean ms", "p50 ms", "p95 ms", "max ms", "found");
+	for(const Run& run: runs)
+	{
+		auto found = std::count_if(run.found.begin(), run.found.end(), [](auto& r){ return r.area() > 0; });
+		fmt::print("{:<12} {:8.2f} {:8.2f} {:8.2f} {:8.2f} {:7}\n", run.name,
+		           mean(run.ms), percentile(run.ms, 0.5), percentile(run.ms, 0.95), percentile(run.ms, 1.0), found);
+	}
+
+	// how often the faster modes land on the same spot as the exhaustive search
+	const Run& ref = runs.front();
+	for(usz r = 1; r < runs.size(); r++)
+	{
+		usz same = 0, both = 0;
+		for(usz i = 0; i < ref.found.size(); i++)
+		{
+			const auto &a = ref.found[i], &b = runs[r].found[i];
+			if(a.area() <= 0 || b.area() <= 0) continue;
+			both++;
+			f64 dx = (a.x + a.width/2) - (b.x + b.width/2);
+			f64 dy = (a.y + a.height/2) - (b.y + b.height/2);
+			if(dx*dx + dy*dy <= 4.0*4.0) same++;
+		}
+		fmt::print("{}: {}/{} matches within 4px of {}\n", runs[r].name, same, both, ref.name);
+	}
+
+	return 0;
+}
+
+int main(int argc, const char* argv[])
+{
+	slog::set_pattern("[%Y-%m-%d %H:%M:%S %L] %n: %v");
+
+	argh::parser opts(argc, argv);
+	conf.input = opts[1];
+	opts({"-n", "--frames"}, conf.frames) >> conf.frames;
+	opts({"--cam-pattern"}, conf.pattern_path) >> conf.pattern_path;
+	opts({"--cam-match-val"}, conf.match_value) >> conf.match_value;
+	opts({"--width"}, conf.width) >> conf.width;
+	opts({"--height"}, conf.height) >> conf.height;
+	opts({"--iterations"}, conf.iterations) >> conf.iterations;
+	opts({"--threads"}, conf.threads) >> conf.threads;
+	opts({"--method"}, conf.method) >> conf.method;
+	opts({"--tracker"}, conf.tracker) >> conf.tracker;
+	opts({"--reacquire"}, conf.reacquire) >> conf.reacquire;
+	opts({"--budget"}, conf.budget_ms) >> conf.budget_ms;
+	opts({"--json"}, conf.json_path) >> conf.json_path;
+	conf.pyramid = opts["--pyramid"];
+	conf.color = opts["--color"];
+	conf.compare = opts["--compare"];
+
+	logger = new_loggr("bench");
+	if(conf.input.empty())
+	{
+		logger->error("usage: {} <video or image sequence like img_%03d.png> [--cam-pattern <file>] [-n <frames>] "
+		              "[--method sqdiff|ccorr|ccoeff] [--tracker KCF|MEDIANFLOW] [--pyramid] [--threads <n>] "
+		              "[--color] [--budget <ms>] [--width <px> --height <px>] [--json <file>] [--compare]", argv[0]);
+		return 1;
+	}
+
+	auto method = match_methods.find(conf.method);
+	if(method == match_methods.end())
+	{
+		logger->error("unknown match method {}", conf.method);
+		return 1;
+	}
+
+	try {
+		// every frame of the recording, as fast as the stages allow
+		FileSource source(conf.input, false);
+		source.set_resolution(conf.width, conf.height);
+
+		SyncCamera cam(conf.input, conf.pattern_path);
+		cam.set_matchval(conf.match_value);
+		cam.set_match_threads(conf.threads);
+		cam.set_track_budget(conf.budget_ms);
+		if(conf.pyramid)
+			cam.set_search_mode(SyncCamera::SearchMode::Pyramid);
+		if(conf.color)
+			cam.set_color_mode(SyncCamera::ColorMode::Color);
+
+		logger->info("replaying {} at {}x{}", conf.input, conf.width, conf.height);
+		return conf.compare
+		        ? compare(cam, source, method->second)
+		        : replay(cam, source, method->second);
+	} catch(std::runtime_error& ex)
+	{
+		logger->error("{}", ex.what());
+	}
+	return 1;
+}
@@ -0,0 +1,118 @@
+#include "test.hpp"
+
+#include "driver.hpp"
+#include "handler_memory.hpp"
+
+#include <boost/asio/steady_timer.hpp>
+
+#include <atomic>
+#include <new>
+
+/* allocation free packet path
+ * Driver <-> sp-driver-emu, every operator new after the warm-up fails the test
+*/
+
+// the replacements below pair malloc with free, which gcc can't see through
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+static std::atomic<bool> counting {false};
+static std::atomic<u64> allocs {0};
+
+void* operator new(std::size_t size)
+{
+	if(counting)
+		allocs++;
+	if(void *p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+constexpr auto TICK = std::chrono::milliseconds(5);
+constexpr auto WARM_UP = std::chrono::milliseconds(500);
+constexpr auto MEASURE = std::chrono::seconds(2);
+
+int main(int argc, const char* argv[])
+{
+	if(argc < 2)
+	{
+		std::fprintf(stderr, "usage: %s <sp-driver-emu>\n", argv[0]);
+		return 2;
+	}
+
+	test::Emu emu(argv[1], {"--distance", "150"});
+	CHECK(!emu.path.empty());
+	if(emu.path.empty())
+		return test::result();
+
+	slog::set_level(slog::level::warn);
+
+	io_context ctx;
+	Driver drv(ctx, emu.path.c_str());
+
+	struct {
+		u32 analog = 0, gap = 0, analog_stream = 0, gap_stream = 0, errors = 0;
+	} got, at_start;
+
+	drv.analog_stream(1, std::chrono::milliseconds(20), [&](auto ec, u8){ ec ? got.errors++ : got.analog_stream++; });
+	drv.gap_stream(2, std::chrono::milliseconds(30), 3, [&](auto ec, Driver::Gap){ ec ? got.errors++ : got.gap_stream++; });
+
+	// paced requests, slow enough that the queue never fills
+	HandlerMemory tick_mem;
+	steady_timer tick(ctx);
+	u32 n = 0;
+	std::function<void(std::error_code)> on_tick = [&](std::error_code ec)
+	{
+		if(ec) return;
+
+		drv.drive(i32(n % 8) - 4);
+		drv.analog(0, [&](auto ec, u8){ ec ? got.errors++ : got.analog++; });
+		if(n % 4 == 0)
+			drv.gap(3, [&](auto ec, u8){ ec ? got.errors++ : got.gap++; });
+		n++;
+
+		tick.expires_after(TICK);
+		tick.async_wait(bind_memory(tick_mem, [&](auto ec){ on_tick(ec); }));
+	};
+	on_tick({});
+
+	steady_timer phase(ctx);
+	phase.expires_after(WARM_UP);
+	phase.async_wait(bind_memory(tick_mem, [&](auto)
+	{
+		at_start = got;
+		counting = true;
+
+		phase.expires_after(MEASURE);
+		phase.async_wait(bind_memory(tick_mem, [&](auto)
+		{
+			counting = false;
+			ctx.stop();
+		}));
+	}));
+
+	ctx.run();
+
+	const auto motor = drv.stats().types[proto::Type::MOTOR];
+	std::printf("allocations: %llu, analog %u, gap %u, analog stream %u, gap stream %u, motor replies %u, errors %u\n",
+	            (unsigned long long)allocs.load(), got.analog - at_start.analog, got.gap - at_start.gap,
+	            got.analog_stream - at_start.analog_stream, got.gap_stream - at_start.gap_stream, motor.replies, got.errors);
+
+	CHECK_EQ(allocs.load(), 0u);
+	CHECK_EQ(got.errors, 0u);
+	// the traffic really flowed while counting
+	CHECK(got.analog - at_start.analog > 200);
+	CHECK(got.gap - at_start.gap > 50);
+	CHECK(got.analog_stream - at_start.analog_stream > 50);
+	CHECK(got.gap_stream - at_start.gap_stream > 30);
+	CHECK(motor.replies > 100);
+
+	return test::result();
+}
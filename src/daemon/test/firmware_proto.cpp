@@ -0,0 +1,315 @@
+#include "test.hpp"
+
+#include "proto-def.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+
+/* firmware protocol
+ * raw packets <-> sp-driver-emu, replies compared byte for byte
+*/
+
+using namespace proto;
+using Bytes = std::vector<uint8_t>;
+using test_clock = std::chrono::steady_clock;
+
+constexpr auto WAIT = std::chrono::milliseconds(500);
+// long enough for every ping the firmware could still have queued
+constexpr auto QUIET = std::chrono::milliseconds(60);
+
+// sensors on the mocked board
+constexpr uint8_t PIN_A = 2, PIN_B = 3, PIN_C = 4;
+constexpr uint8_t MM_A = 100, MM_B = 60, MM_C = 200;
+constexpr uint8_t ANALOG_PIN = 1, ANALOG_VAL = 127; // 512 of 1023
+constexpr uint8_t BOARD_PINS = 20;                  // NUM_DIGITAL_PINS of the Uno
+
+static int fd = -1;
+static std::vector<Bytes> pending; // read ahead while looking for another packet
+
+static Bytes pkt(uint8_t type, uint8_t seq, Bytes data = {})
+{
+	data.insert(data.begin(), { BYTE_SYNC, type, seq, uint8_t(data.size()) });
+	data.push_back(BYTE_END);
+	return data;
+}
+
+static std::string hex(const Bytes& b)
+{
+	std::string out;
+	char buf[4];
+	for(uint8_t c: b)
+	{
+		std::snprintf(buf, sizeof(buf), "%02x ", c);
+		out += buf;
+	}
+	return out.empty() ? "(nothing)" : out;
+}
+
+static void send(const Bytes& b)
+{
+	if(write(fd, b.data(), b.size()) != ssize_t(b.size()))
+		std::perror("write");
+}
+
+/**
+ * @return Next byte, -1 after timeout
+ */
+static int get(test_clock::time_point until)
+{
+	for(;;)
+	{
+		uint8_t c;
+		if(read(fd, &c, 1) == 1)
+			return c;
+
+		const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(until - test_clock::now()).count();
+		if(left <= 0)
+			return -1;
+		pollfd pfd { fd, POLLIN, 0 };
+		poll(&pfd, 1, int(left));
+	}
+}
+
+/**
+ * @return Next whole packet, empty after timeout
+ */
+static Bytes next(std::chrono::milliseconds wait = WAIT)
+{
+	if(!pending.empty())
+	{
+		Bytes b = pending.front();
+		pending.erase(pending.begin());
+		return b;
+	}
+
+	const auto until = test_clock::now() + wait;
+	int c;
+	do {
+		c = get(until);
+		if(c < 0) return {};
+	} while(c != BYTE_SYNC);
+
+	Bytes b { BYTE_SYNC };
+	for(int i = 0; i < 3; i++)
+	{
+		if((c = get(until)) < 0) return {};
+		b.push_back(uint8_t(c));
+	}
+	for(int i = 0; i <= b[3]; i++)
+	{
+		if((c = get(until)) < 0) return {};
+		b.push_back(uint8_t(c));
+	}
+	return b;
+}
+
+/**
+ * @return Next packet that isn't a stream reading, those are kept for later
+ */
+static Bytes reply(std::chrono::milliseconds wait = WAIT)
+{
+	std::vector<Bytes> streams;
+	Bytes b;
+	for(;;)
+	{
+		b = next(wait);
+		if(b.empty() || !(b[1] & STREAM_BIT))
+			break;
+		streams.push_back(b);
+	}
+	pending.insert(pending.end(), streams.begin(), streams.end());
+	return b;
+}
+
+static bool expect(const Bytes& got, const Bytes& want, const char* what)
+{
+	if(got == want)
+		return true;
+
+	std::fprintf(stderr, "%s:\n  want %s\n  got  %s\n", what, hex(want).c_str(), hex(got).c_str());
+	test::failures()++;
+	return false;
+}
+
+/**
+ * @brief Send a request and compare the next reply with want
+ */
+static void exchange(const Bytes& req, const Bytes& want, const char* what)
+{
+	send(req);
+	expect(reply(), want, what);
+}
+
+/**
+ * @brief Fail if anything else arrives within QUIET
+ */
+static void silence(const char* what)
+{
+	expect(next(QUIET), {}, what);
+}
+
+int main(int argc, const char* argv[])
+{
+	if(argc < 2)
+	{
+		std::fprintf(stderr, "usage: %s <sp-driver-emu>\n", argv[0]);
+		return 2;
+	}
+
+	char script[] = "/tmp/sp-proto-XXXXXX";
+	const int sfd = mkstemp(script);
+	{
+		std::ofstream out(script);
+		out << "0 distance " << +PIN_A << ' ' << +MM_A << '\n'
+		    << "0 distance " << +PIN_B << ' ' << +MM_B << '\n'
+		    << "0 distance " << +PIN_C << ' ' << +MM_C << '\n';
+	}
+	close(sfd);
+
+	test::Emu emu(argv[1], {"--script", script});
+	unlink(script);
+
+	fd = open(emu.path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+	CHECK(fd >= 0);
+	if(fd < 0)
+		return test::result();
+
+	termios tio;
+	tcgetattr(fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(fd, TCSANOW, &tio);
+
+	uint8_t seq = 0;
+
+	// plain requests
+	exchange(pkt(VERSION, seq, {}), pkt(VERSION, seq, {9}), "version");
+	seq++;
+	exchange(pkt(PING, seq, {}), pkt(PING, seq, {0}), "ping");
+	seq++;
+	exchange(pkt(ANALOG, seq, {ANALOG_PIN}), pkt(ANALOG, seq, {ANALOG_VAL}), "analog");
+	seq++;
+	exchange(pkt(0x3f, seq, {}), pkt(0x3f | ERR_BIT, seq, {INVALID_ARG}), "unknown type");
+	seq++;
+
+	// gap, single and oversampled
+	exchange(pkt(ULTRA_SONIC, seq, {PIN_A}), pkt(ULTRA_SONIC, seq, {MM_A}), "gap");
+	seq++;
+	exchange(pkt(ULTRA_SONIC, seq, {PIN_B, 3}), pkt(ULTRA_SONIC, seq, {MM_B, 0}), "gap of 3 samples");
+	seq++;
+	exchange(pkt(ULTRA_SONIC, seq, {PIN_B, MAX_SAMPLES}), pkt(ULTRA_SONIC, seq, {MM_B, 0}), "gap of most samples");
+	seq++;
+	exchange(pkt(ULTRA_SONIC, seq, {PIN_A, 0}), pkt(ULTRA_SONIC | ERR_BIT, seq, {INVALID_ARG}), "gap of 0 samples");
+	seq++;
+	exchange(pkt(ULTRA_SONIC, seq, {PIN_A, MAX_SAMPLES + 1}), pkt(ULTRA_SONIC | ERR_BIT, seq, {INVALID_ARG}), "gap of too many samples");
+	seq++;
+	exchange(pkt(ULTRA_SONIC, seq, {BOARD_PINS}), pkt(ULTRA_SONIC | ERR_BIT, seq, {INVALID_ARG}), "gap of unknown pin");
+	seq++;
+	exchange(pkt(ULTRA_SONIC, seq, {1}), pkt(ULTRA_SONIC | ERR_BIT, seq, {INVALID_ARG}), "gap on the serial TX pin");
+	seq++;
+
+	// burst, lowest pin first
+	const uint16_t pins = (1u << PIN_A) | (1u << PIN_B) | (1u << PIN_C);
+	exchange(pkt(ULTRA_SONIC_BURST, seq, {uint8_t(pins), uint8_t(pins >> 8)}), pkt(ULTRA_SONIC_BURST, seq, {MM_A, MM_B, MM_C}), "burst");
+	seq++;
+	exchange(pkt(ULTRA_SONIC_BURST, seq, {0, 0}), pkt(ULTRA_SONIC_BURST | ERR_BIT, seq, {INVALID_ARG}), "burst without pins");
+	seq++;
+	exchange(pkt(ULTRA_SONIC_BURST, seq, {0xfc, 0x07}), pkt(ULTRA_SONIC_BURST | ERR_BIT, seq, {INVALID_ARG}), "burst of more than MAX_DATA pins");
+	seq++;
+	exchange(pkt(ULTRA_SONIC_BURST, seq, {0x04}), pkt(ULTRA_SONIC_BURST | ERR_BIT, seq, {INVALID_ARG}), "burst with short bitmap");
+	seq++;
+	// the serial pins, alone and with valid ones
+	exchange(pkt(ULTRA_SONIC_BURST, seq, {0x01, 0}), pkt(ULTRA_SONIC_BURST | ERR_BIT, seq, {INVALID_ARG}), "burst on the serial RX pin");
+	seq++;
+	exchange(pkt(ULTRA_SONIC_BURST, seq, {uint8_t(pins | 0x02), uint8_t(pins >> 8)}), pkt(ULTRA_SONIC_BURST | ERR_BIT, seq, {INVALID_ARG}), "burst with the serial TX pin");
+	seq++;
+
+	// a retransmitted request is answered once
+	{
+		const Bytes req = pkt(ULTRA_SONIC, seq, {PIN_A});
+		send(req);
+		send(req);
+		expect(reply(), pkt(ULTRA_SONIC, seq, {MM_A}), "retransmitted gap");
+		silence("second reply of a retransmitted gap");
+		seq++;
+	}
+
+	// a quick request overtakes a slow one
+	{
+		const uint8_t slow = seq++, quick = seq++;
+		send(pkt(ULTRA_SONIC, slow, {PIN_C, MAX_SAMPLES}));
+		send(pkt(ANALOG, quick, {ANALOG_PIN}));
+		expect(reply(), pkt(ANALOG, quick, {ANALOG_VAL}), "quick request first");
+		expect(reply(), pkt(ULTRA_SONIC, slow, {MM_C, 0}), "slow request second");
+	}
+
+	// the sonar queue holds four requests, all sent at once so none is done before the fifth arrives
+	{
+		const uint8_t first = seq;
+		Bytes all;
+		for(uint8_t i = 0; i < 5; i++)
+		{
+			const Bytes req = pkt(ULTRA_SONIC, seq++, {PIN_A});
+			all.insert(all.end(), req.begin(), req.end());
+		}
+		send(all);
+		expect(reply(), pkt(ULTRA_SONIC | ERR_BIT, uint8_t(first + 4), {NO_SPACE}), "fifth gap");
+		for(uint8_t i = 0; i < 4; i++)
+			expect(reply(), pkt(ULTRA_SONIC, uint8_t(first + i), {MM_A}), "queued gap");
+		silence("after queued gaps");
+	}
+
+	// streams
+	exchange(pkt(SUBSCRIBE, seq, {ANALOG, ANALOG_PIN, 20, 0, 2}), pkt(SUBSCRIBE | ERR_BIT, seq, {INVALID_ARG}), "analog stream of 2 samples");
+	seq++;
+	exchange(pkt(SUBSCRIBE, seq, {MOTOR, ANALOG_PIN, 20, 0}), pkt(SUBSCRIBE | ERR_BIT, seq, {INVALID_ARG}), "stream of motor");
+	seq++;
+	exchange(pkt(SUBSCRIBE, seq, {ANALOG, ANALOG_PIN, 20}), pkt(SUBSCRIBE | ERR_BIT, seq, {INVALID_ARG}), "short subscription");
+	seq++;
+	exchange(pkt(SUBSCRIBE, seq, {ULTRA_SONIC, 0, 30, 0}), pkt(SUBSCRIBE | ERR_BIT, seq, {INVALID_ARG}), "gap stream on the serial RX pin");
+	seq++;
+
+	exchange(pkt(SUBSCRIBE, seq, {ANALOG, ANALOG_PIN, 20, 0}), pkt(SUBSCRIBE, seq, {0}), "analog stream");
+	seq++;
+	exchange(pkt(SUBSCRIBE, seq, {ULTRA_SONIC, PIN_B, 30, 0, 3}), pkt(SUBSCRIBE, seq, {0}), "gap stream of 3 samples");
+	seq++;
+
+	{
+		uint8_t analog_seq = 0, gap_seq = 0;
+		while(analog_seq < 5 || gap_seq < 3)
+		{
+			const Bytes b = next();
+			if(b.empty())
+			{
+				expect(b, pkt(ANALOG | STREAM_BIT, analog_seq, {ANALOG_PIN, ANALOG_VAL}), "stream reading");
+				break;
+			}
+			if(b[1] == (ANALOG | STREAM_BIT))
+				expect(b, pkt(ANALOG | STREAM_BIT, analog_seq++, {ANALOG_PIN, ANALOG_VAL}), "analog stream reading");
+			else
+				expect(b, pkt(ULTRA_SONIC | STREAM_BIT, gap_seq++, {PIN_B, MM_B, 0}), "gap stream reading");
+		}
+	}
+
+	// ending both, readings already on the way are ignored
+	exchange(pkt(SUBSCRIBE, seq, {ANALOG, ANALOG_PIN, 0, 0}), pkt(SUBSCRIBE, seq, {0}), "end analog stream");
+	seq++;
+	exchange(pkt(SUBSCRIBE, seq, {ULTRA_SONIC, PIN_B, 0, 0}), pkt(SUBSCRIBE, seq, {0}), "end gap stream");
+	seq++;
+	pending.clear();
+	while(!next(QUIET).empty()) {}
+	expect(next(std::chrono::milliseconds(100)), {}, "reading after the streams ended");
+
+	// all four stream slots, the fifth is refused
+	for(uint8_t p = 0; p < MAX_STREAMS; p++)
+		exchange(pkt(SUBSCRIBE, seq, {ANALOG, p, 0xe8, 0x03}), pkt(SUBSCRIBE, seq, {0}), "stream slot"), seq++;
+	exchange(pkt(SUBSCRIBE, seq, {ANALOG, MAX_STREAMS, 0xe8, 0x03}), pkt(SUBSCRIBE | ERR_BIT, seq, {NO_SPACE}), "fifth stream");
+	seq++;
+
+	close(fd);
+	return test::result();
+}
@@ -0,0 +1,131 @@
+#include "test.hpp"
+
+#include "control.hpp"
+#include "def.hpp"
+#include "multicast.hpp"
+
+#include <boost/asio/steady_timer.hpp>
+
+/* control multicast
+ * ControlCast sender -> loopback -> ControlCast receiver -> ControlFilter
+*/
+
+using test_clock = std::chrono::steady_clock;
+
+constexpr auto REPEAT = std::chrono::milliseconds(100);
+
+int main()
+{
+	slog::set_level(slog::level::warn);
+
+	// parallel runs shouldn't hear each other
+	const u16 port = u16(40000 + getpid() % 20000);
+
+	io_context ctx;
+	ControlCast rx(ctx, def::MULTICAST_GROUP, port, "127.0.0.1");
+	ControlCast tx(ctx, def::MULTICAST_GROUP, port, "127.0.0.1", REPEAT);
+	ControlCast late(ctx, def::MULTICAST_GROUP, port, "127.0.0.1", std::chrono::milliseconds(0));
+
+	ControlFilter filter;
+	std::vector<Control> applied;
+	std::vector<test_clock::time_point> arrivals;
+	rx.listen([&](const Control& ctl)
+	{
+		arrivals.push_back(test_clock::now());
+		if(filter.accept(ctl))
+			applied.push_back(ctl);
+	});
+
+	// steps of the scenario, in ms since the start
+	steady_timer timer(ctx);
+	std::vector<std::pair<std::chrono::milliseconds, std::function<void()>>> steps;
+	auto at = [&](u32 ms, std::function<void()> fn){ steps.emplace_back(std::chrono::milliseconds(ms), std::move(fn)); };
+
+	Control ctl;
+	auto next = [&](u32 seq, i16 speed)
+	{
+		ctl.seq = seq;
+		ctl.speed = speed;
+		ctl.time_us = Control::now_us();
+		tx.send(ctl);
+	};
+
+	Control lost_ctl;
+	usz arrivals_before_idle = 0;
+
+	at(0, [&]{ next(1, 1); });
+	at(20, [&]{ next(2, 2); });
+	at(40, [&]{ next(3, 3); });
+	// 4 and 5 get lost
+	at(60, [&]{ next(6, 6); });
+	at(70, [&]{ arrivals_before_idle = arrivals.size(); });
+	// ...the last one is repeated while the input rests
+	at(330, [&]
+	{
+		const ControlCast::Stats s = rx.stats();
+		CHECK_EQ(s.received, 4u + 2u);
+		CHECK_EQ(s.lost, 2u);
+		CHECK_EQ(s.repeated, 2u);
+		CHECK_EQ(s.late, 0u);
+
+		CHECK_EQ(arrivals.size(), arrivals_before_idle + 2);
+		if(arrivals.size() == arrivals_before_idle + 2)
+		{
+			const auto gap = arrivals[arrivals_before_idle + 1] - arrivals[arrivals_before_idle];
+			CHECK(gap > REPEAT * 8 / 10 && gap < REPEAT * 15 / 10);
+		}
+
+		// an old message, e.g. one that took the long way
+		lost_ctl.seq = 5;
+		lost_ctl.speed = 5;
+		lost_ctl.time_us = ctl.time_us;
+		late.send(lost_ctl);
+	});
+	at(350, [&]
+	{
+		CHECK_EQ(rx.stats().late, 1u);
+
+		// a restarted sender counts from 1 again
+		ctl.time_us = Control::now_us() + 2 * ControlFilter::RESTART_US;
+		ctl.seq = 1;
+		ctl.speed = 10;
+		tx.send(ctl);
+	});
+	at(370, [&]{ ctx.stop(); });
+
+	usz step = 0;
+	const auto start = test_clock::now();
+	std::function<void(std::error_code)> run = [&](std::error_code ec)
+	{
+		if(ec || step == steps.size()) return;
+
+		steps[step++].second();
+		if(step == steps.size()) return;
+
+		timer.expires_at(start + steps[step].first);
+		timer.async_wait([&](auto ec){ run(ec); });
+	};
+	run({});
+
+	// give up if something hangs
+	steady_timer guard(ctx);
+	guard.expires_after(std::chrono::seconds(5));
+	guard.async_wait([&](auto ec){ if(!ec) { CHECK(!"timed out"); ctx.stop(); } });
+
+	ctx.run();
+
+	// every new message once, repeats and the late one dropped
+	std::vector<i16> speeds;
+	for(const Control &c: applied)
+		speeds.push_back(c.speed);
+	CHECK(speeds == (std::vector<i16>{1, 2, 3, 6, 10}));
+	CHECK_EQ(filter.stale, 2u + 1u);
+
+	const ControlCast::Stats s = rx.stats();
+	std::printf("received %u, lost %u, repeated %u, late %u, invalid %u, applied %zu, stale %u\n",
+	            s.received, s.lost, s.repeated, s.late, s.invalid, applied.size(), filter.stale);
+	CHECK_EQ(s.lost, 2u);
+	CHECK_EQ(s.invalid, 0u);
+
+	return test::result();
+}
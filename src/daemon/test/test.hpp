@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <csignal>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* minimal test support
+ * checks count failures, main returns test::result()
+*/
+
+namespace test
+{
+
+inline int& failures()
+{
+	static int n = 0;
+	return n;
+}
+
+inline int result()
+{
+	if(failures())
+		std::fprintf(stderr, "%d check(s) failed\n", failures());
+	return failures() ? 1 : 0;
+}
+
+/**
+ * @brief sp-driver-emu running in the background as long as this lives
+ */
+struct Emu
+{
+	/**
+	 * @param bin   Path of sp-driver-emu
+	 * @param args  Options of the emulator
+	 */
+	Emu(const char* bin, std::vector<std::string> args = {})
+	{
+		int out[2];
+		if(pipe(out))
+			return;
+
+		pid = fork();
+		if(pid == 0)
+		{
+			dup2(out[1], STDOUT_FILENO);
+			// the motor log of the emulator would drown the test output
+			const int null = open("/dev/null", O_WRONLY);
+			dup2(null, STDERR_FILENO);
+			close(out[0]);
+			close(out[1]);
+
+			std::vector<char*> argv { const_cast<char*>(bin) };
+			for(auto &a: args)
+				argv.push_back(&a[0]);
+			argv.push_back(nullptr);
+			execv(bin, argv.data());
+			std::_Exit(127);
+		}
+		close(out[1]);
+
+		// the first line is the pseudo terminal to connect to
+		char c;
+		while(read(out[0], &c, 1) == 1 && c != '\n')
+			path += c;
+		close(out[0]);
+	}
+
+	~Emu()
+	{
+		if(pid <= 0)
+			return;
+		kill(pid, SIGTERM);
+		waitpid(pid, nullptr, 0);
+	}
+
+	pid_t pid = -1;
+	std::string path;
+};
+
+}
+
+#define CHECK(cond) \
+	do { if(!(cond)) { std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); test::failures()++; } } while(0)
+
+#define CHECK_EQ(a, b) \
+	do { const auto a_ = (a); const auto b_ = (b); if(!(a_ == b_)) { \
+		std::fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__, #a, #b, (long long)a_, (long long)b_); \
+		test::failures()++; } } while(0)
@@ -0,0 +1,64 @@
+#pragma once
+
+/**
+ * @brief Minimal Arduino core for running the firmware on a Linux host
+ */
+
+#include "avr/io.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT  0x0
+#define OUTPUT 0x1
+
+#define LED_BUILTIN 13
+#define NUM_DIGITAL_PINS 20
+
+// pin change interrupts as on the Uno
+#define digitalPinToPCICR(p)    (((p) <= 21) ? (&PCICR) : ((volatile uint8_t *)0))
+#define digitalPinToPCICRbit(p) (((p) <= 7) ? 2 : (((p) <= 13) ? 0 : 1))
+#define digitalPinToPCMSK(p)    (((p) <= 7) ? (&PCMSK2) : (((p) <= 13) ? (&PCMSK0) : (((p) <= 21) ? (&PCMSK1) : ((volatile uint8_t *)0))))
+#define digitalPinToPCMSKbit(p) (((p) <= 7) ? (p) : (((p) <= 13) ? ((p) - 8) : ((p) - 14)))
+
+#define ISR(vector) extern "C" void vector()
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+long map(long x, long in_min, long in_max, long out_min, long out_max);
+
+/**
+ * @brief Serial port backed by the pseudo terminal of the emulator
+ */
+struct HardwareSerial
+{
+	void begin(unsigned long baud);
+	int available();
+	int read();
+	size_t write(uint8_t b);
+	size_t write(const uint8_t *data, size_t len);
+};
+
+extern HardwareSerial Serial;
+
+// implemented by the firmware
+void setup();
+void loop();
@@ -0,0 +1,24 @@
+#pragma once
+
+/**
+ * @brief ATmega328P registers used by the firmware, as plain variables
+ */
+
+#include <stdint.h>
+
+extern volatile uint8_t OCR2A, TCNT2, TCCR2A, TCCR2B, TIMSK2;
+extern volatile uint8_t PCICR, PCIFR, PCMSK0, PCMSK1, PCMSK2;
+
+#define _BV(bit) (1 << (bit))
+
+#define OCIE2A 1
+
+#define COM2A1 7
+#define COM2A0 6
+#define WGM21  1
+#define WGM20  0
+
+#define WGM22 3
+#define CS22  2
+#define CS21  1
+#define CS20  0
@@ -0,0 +1,497 @@
+#include "Arduino.h"
+#include "avr/wdt.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+/* firmware emulator
+ * pty <-> firmware main.cpp on a mocked Arduino core
+*/
+
+extern "C" void TIMER2_COMPA_vect();
+extern "C" void PCINT0_vect();
+extern "C" void PCINT1_vect();
+extern "C" void PCINT2_vect();
+
+using emu_clock = std::chrono::steady_clock;
+
+volatile uint8_t OCR2A, TCNT2, TCCR2A, TCCR2B, TIMSK2;
+volatile uint8_t PCICR, PCIFR, PCMSK0, PCMSK1, PCMSK2;
+
+// the sensor sends its burst before the echo line goes high
+constexpr auto ECHO_HOLDOFF = std::chrono::microseconds(750);
+// how long an edge waits for its interrupt to be enabled, a preempted emulator may arm it late
+constexpr auto ECHO_MASKED_WAIT = std::chrono::milliseconds(4);
+
+HardwareSerial Serial;
+
+/**
+ * @brief Scripted change of the simulated hardware
+ */
+struct Event
+{
+	unsigned long time;  ///< ms since start
+	std::string cmd;
+	long a, b;
+};
+
+/**
+ * @brief Echo line of an ultra sonic sensor after a trigger pulse
+ */
+struct Echo
+{
+	emu_clock::time_point rise, fall;
+	bool pending = false;  ///< edges left to deliver
+	bool high = false;
+};
+
+/**
+ * @brief Serial bytes written by one loop() run, released after the jitter
+ */
+struct Chunk
+{
+	emu_clock::time_point release;
+	std::vector<uint8_t> data;
+};
+
+static struct
+{
+	int master = -1, slave = -1;
+	std::string link;
+	emu_clock::time_point start = emu_clock::now();
+
+	std::deque<uint8_t> in;
+	std::vector<uint8_t> out_cur;
+	std::deque<Chunk> out;
+
+	std::map<uint8_t, long> distance; ///< mm per pin, 0 for no echo
+	uint8_t mode[NUM_DIGITAL_PINS] {};
+	uint8_t level[NUM_DIGITAL_PINS] {}; ///< written by the firmware
+	Echo echo[NUM_DIGITAL_PINS];
+	std::map<uint8_t, long> analog;   ///< raw 0..1023 per pin
+	long distance_def = 150;
+	long noise = 0;                      ///< mm an echo deviates at most
+	long analog_def = 512;
+	long jitter_min = 0, jitter_max = 0; ///< us added before a response leaves
+	long loss = 0;                       ///< percent of responses dropped
+
+	std::deque<Event> script;
+	std::mt19937 rng {1337};
+
+	long wdt_ms = -1;
+	emu_clock::time_point wdt_last;
+	bool wdt_missed = false;
+
+	uint8_t motor = 0;
+
+	bool in_irq = false;
+	emu_clock::time_point irq_at; ///< time of the edge an interrupt handles
+} emu;
+
+static bool echo_edges();
+
+/**
+ * @brief Current time, an interrupt sees the time of its edge
+ */
+static emu_clock::time_point now()
+{
+	if(emu.in_irq)
+		return emu.irq_at;
+
+	// interrupts of edges due meanwhile run first, even if the emulator was preempted
+	const auto t = emu_clock::now();
+	echo_edges();
+	return t;
+}
+
+// Arduino core
+//##############
+void pinMode(uint8_t pin, uint8_t mode)
+{
+	if(pin < NUM_DIGITAL_PINS)
+		emu.mode[pin] = mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+	if(pin >= NUM_DIGITAL_PINS)
+		return;
+
+	// end of a trigger pulse, sound needs 5.8us per mm there and back
+	if(emu.mode[pin] == OUTPUT && emu.level[pin] == HIGH && val == LOW)
+	{
+		auto it = emu.distance.find(pin);
+		long mm = it != emu.distance.end() ? it->second : emu.distance_def;
+		if(mm > 0 && emu.noise > 0)
+			mm = std::max(1L, mm + random(-emu.noise, emu.noise + 1));
+
+		const auto t = now();
+		Echo &e = emu.echo[pin];
+		e.high = false;
+		e.pending = mm > 0;
+		e.rise = t + ECHO_HOLDOFF;
+		e.fall = e.rise + std::chrono::microseconds(long(mm * 5.8));
+	}
+	emu.level[pin] = val;
+}
+
+int digitalRead(uint8_t pin)
+{
+	return pin < NUM_DIGITAL_PINS && emu.echo[pin].high ? HIGH : LOW;
+}
+
+int analogRead(uint8_t pin)
+{
+	auto it = emu.analog.find(pin);
+	return it != emu.analog.end() ? int(it->second) : int(emu.analog_def);
+}
+
+unsigned long millis()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(now() - emu.start).count();
+}
+
+unsigned long micros()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(now() - emu.start).count();
+}
+
+void delay(unsigned long ms)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us)
+{
+	std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+long random(long max)
+{
+	return max > 0 ? std::uniform_int_distribution<long>(0, max - 1)(emu.rng) : 0;
+}
+
+long random(long min, long max)
+{
+	return min + random(max - min);
+}
+
+void randomSeed(unsigned long seed)
+{
+	emu.rng.seed(seed);
+}
+
+long map(long x, long in_min, long in_max, long out_min, long out_max)
+{
+	return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+void HardwareSerial::begin(unsigned long) {}
+
+int HardwareSerial::available()
+{
+	uint8_t buf[64];
+	ssize_t len = ::read(emu.master, buf, sizeof(buf));
+	if(len > 0)
+		emu.in.insert(emu.in.end(), buf, buf + len);
+	return int(emu.in.size());
+}
+
+int HardwareSerial::read()
+{
+	if(emu.in.empty() && !available())
+		return -1;
+	int b = emu.in.front();
+	emu.in.pop_front();
+	return b;
+}
+
+size_t HardwareSerial::write(uint8_t b)
+{
+	emu.out_cur.push_back(b);
+	return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *data, size_t len)
+{
+	emu.out_cur.insert(emu.out_cur.end(), data, data + len);
+	return len;
+}
+
+void wdt_enable(uint8_t timeout)
+{
+	emu.wdt_ms = 15L << timeout;
+	emu.wdt_last = emu_clock::now();
+}
+
+void wdt_reset()
+{
+	emu.wdt_last = emu_clock::now();
+	emu.wdt_missed = false;
+}
+
+void wdt_disable()
+{
+	emu.wdt_ms = -1;
+}
+
+// Emulator
+//##########
+static bool apply(const Event &ev)
+{
+	if(ev.cmd == "distance")   emu.distance[uint8_t(ev.a)] = ev.b;
+	else if(ev.cmd == "analog") emu.analog[uint8_t(ev.a)] = ev.b;
+	else if(ev.cmd == "jitter") { emu.jitter_min = ev.a; emu.jitter_max = std::max(ev.a, ev.b); }
+	else if(ev.cmd == "loss")   emu.loss = ev.a;
+	else if(ev.cmd == "noise")  emu.noise = ev.a;
+	else return false;
+
+	std::fprintf(stderr, "emu: %lums %s %ld %ld\n", millis(), ev.cmd.c_str(), ev.a, ev.b);
+	return true;
+}
+
+/**
+ * @brief Load events, one per line: <time ms> <command> <args...>
+ */
+static bool load_script(const std::string &path)
+{
+	std::ifstream file(path);
+	if(!file)
+	{
+		std::fprintf(stderr, "emu: can't open %s\n", path.c_str());
+		return false;
+	}
+
+	std::string line;
+	for(int n = 1; std::getline(file, line); n++)
+	{
+		if(line.empty() || line[0] == '#')
+			continue;
+
+		std::istringstream ss(line);
+		Event ev {0, {}, 0, 0};
+		if(!(ss >> ev.time >> ev.cmd >> ev.a))
+		{
+			std::fprintf(stderr, "emu: %s:%d: expected <time ms> <command> <args>\n", path.c_str(), n);
+			return false;
+		}
+		ss >> ev.b;
+		emu.script.push_back(ev);
+	}
+
+	std::stable_sort(emu.script.begin(), emu.script.end(), [](auto &a, auto &b){ return a.time < b.time; });
+	return true;
+}
+
+static bool open_pty()
+{
+	emu.master = posix_openpt(O_RDWR | O_NOCTTY);
+	if(emu.master < 0 || grantpt(emu.master) || unlockpt(emu.master))
+		return false;
+
+	const char *path = ptsname(emu.master);
+	// keep our own handle, so the master doesn't hang up when a client disconnects
+	emu.slave = open(path, O_RDWR | O_NOCTTY);
+	if(emu.slave < 0)
+		return false;
+
+	termios tio;
+	tcgetattr(emu.slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(emu.slave, TCSANOW, &tio);
+
+	fcntl(emu.master, F_SETFL, fcntl(emu.master, F_GETFL) | O_NONBLOCK);
+
+	if(!emu.link.empty())
+	{
+		unlink(emu.link.c_str());
+		if(symlink(path, emu.link.c_str()))
+		{
+			std::perror("emu: symlink");
+			return false;
+		}
+		path = emu.link.c_str();
+	}
+
+	std::printf("%s\n", path);
+	std::fflush(stdout);
+	return true;
+}
+
+/**
+ * @brief Put due echo edges on the pins and raise their pin change interrupts
+ * @return Whether edges are still to come
+ */
+static bool echo_edges()
+{
+	bool pending = false;
+	for(uint8_t pin = 0; pin < NUM_DIGITAL_PINS; pin++)
+	{
+		Echo &e = emu.echo[pin];
+		while(e.pending)
+		{
+			const auto at = e.high ? e.fall : e.rise;
+			const auto t = emu_clock::now();
+			if(at > t)
+				break;
+
+			const bool masked = !(*digitalPinToPCICR(pin) & _BV(digitalPinToPCICRbit(pin))) || !(*digitalPinToPCMSK(pin) & _BV(digitalPinToPCMSKbit(pin)));
+			if(masked && t - at < ECHO_MASKED_WAIT)
+				break;
+
+			e.high = !e.high;
+			e.pending = e.high;
+			if(masked)
+				continue;
+
+			// the interrupt runs right at the edge, whenever the emulator gets to it
+			emu.in_irq = true;
+			emu.irq_at = at;
+			if(pin <= 7)       PCINT2_vect();
+			else if(pin <= 13) PCINT0_vect();
+			else               PCINT1_vect();
+			emu.in_irq = false;
+		}
+		pending |= e.pending;
+	}
+	return pending;
+}
+
+/**
+ * @brief Everything the hardware does between two loop() runs
+ */
+static void step()
+{
+	const auto now = emu_clock::now();
+
+	while(!emu.script.empty() && emu.script.front().time <= millis())
+	{
+		if(!apply(emu.script.front()))
+			std::fprintf(stderr, "emu: unknown script command %s\n", emu.script.front().cmd.c_str());
+		emu.script.pop_front();
+	}
+
+	// timer 2 compare match, takes the new motor speed
+	if(TIMSK2 & (1 << OCIE2A))
+		TIMER2_COMPA_vect();
+	if(OCR2A != emu.motor)
+	{
+		emu.motor = OCR2A;
+		std::fprintf(stderr, "emu: %lums motor 0x%02x\n", millis(), emu.motor);
+	}
+
+	if(emu.wdt_ms >= 0 && !emu.wdt_missed && now - emu.wdt_last > std::chrono::milliseconds(emu.wdt_ms))
+	{
+		emu.wdt_missed = true;
+		std::fprintf(stderr, "emu: %lums watchdog would reset the board\n", millis());
+	}
+
+	if(!emu.out_cur.empty())
+	{
+		if(random(100) >= emu.loss)
+		{
+			long us = emu.jitter_min + random(emu.jitter_max - emu.jitter_min + 1);
+			// never overtake an earlier response
+			auto release = std::max(now + std::chrono::microseconds(us), emu.out.empty() ? now : emu.out.back().release);
+			emu.out.push_back({release, std::move(emu.out_cur)});
+		}
+		emu.out_cur.clear();
+	}
+
+	while(!emu.out.empty() && emu.out.front().release <= now)
+	{
+		auto &data = emu.out.front().data;
+		if(0> ::write(emu.master, data.data(), data.size()) && errno != EAGAIN)
+			std::perror("emu: write");
+		emu.out.pop_front();
+	}
+
+	// sleep until input arrives, but keep the firmware loop going for streams and timeouts
+	const bool echo = echo_edges();
+	if(emu.in.empty())
+	{
+		pollfd pfd { emu.master, POLLIN, 0 };
+		poll(&pfd, 1, emu.out.empty() && !echo ? 1 : 0);
+	}
+	echo_edges();
+}
+
+static void stop(int)
+{
+	if(!emu.link.empty())
+		unlink(emu.link.c_str());
+	std::_Exit(0);
+}
+
+int main(int argc, const char* argv[])
+{
+	for(int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		const char *val = i + 1 < argc ? argv[i + 1] : nullptr;
+		if(!val && arg != "-h" && arg != "--help")
+		{
+			std::fprintf(stderr, "emu: %s needs a value\n", arg.c_str());
+			return 1;
+		}
+
+		if(arg == "--link")               emu.link = argv[++i];
+		else if(arg == "--distance")      emu.distance_def = std::atol(argv[++i]);
+		else if(arg == "--analog")        emu.analog_def = std::atol(argv[++i]);
+		else if(arg == "--loss")          emu.loss = std::atol(argv[++i]);
+		else if(arg == "--noise")         emu.noise = std::atol(argv[++i]);
+		else if(arg == "--jitter")
+		{
+			if(2 != std::sscanf(argv[++i], "%ld,%ld", &emu.jitter_min, &emu.jitter_max))
+				emu.jitter_min = emu.jitter_max = std::atol(argv[i]);
+		}
+		else if(arg == "--script")
+		{
+			if(!load_script(argv[++i]))
+				return 1;
+		}
+		else
+		{
+			std::fprintf(stderr,
+			             "usage: %s [--link <path>] [--distance <mm>] [--noise <mm>] [--analog <0-1023>] [--jitter <min us>[,<max us>]]\n"
+			             "          [--loss <percent>] [--script <file>]\n"
+			             "script lines: <time ms> distance <pin> <mm> | noise <mm> | analog <pin> <value> | jitter <min us> <max us>\n"
+			             "              | loss <percent>\n",
+			             argv[0]);
+			return 1;
+		}
+	}
+
+	if(!open_pty())
+	{
+		std::perror("emu: pty");
+		return 1;
+	}
+
+	std::signal(SIGINT, stop);
+	std::signal(SIGTERM, stop);
+
+	setup();
+	for(;;)
+	{
+		loop();
+		step();
+	}
+}
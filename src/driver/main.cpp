@@ -9,31 +9,14 @@
 
 #include <stdint.h>
 
-#define FW_VERSION 4
-
 #define MOTOR_PIN 11
+#define SERIAL_PINS 0x3 // D0 and D1 carry the serial link, no sensor may drive them
 #define PING_TIMEOUT_MS 200
-#define PING_PIN 7
-#define US_TIMEOUT_MIS 4000 // 18500
 
 
-// UltraSonic
-//############
-uint8_t us_distance(uint8_t pin = PING_PIN)
+uint8_t analog(uint8_t pin)
 {
-	// start
-	pinMode(pin, OUTPUT);
-	digitalWrite(pin, LOW);
-	delayMicroseconds(2);
-	digitalWrite(pin, HIGH);
-	delayMicroseconds(5);
-	digitalWrite(pin, LOW);
-
-	// wait for echo
-	pinMode(pin, INPUT);
-	uint32_t dur = pulseIn(pin, HIGH, US_TIMEOUT_MIS); // 18500
-
-	return dur < 1450 ? dur / 5.8 : 255;
+	return map(analogRead(pin), 0, 1023, 0, 255);
 }
 
 // Motor control
@@ -116,13 +99,306 @@ using namespace proto;
 
 enum State
 {
-	SYNC, DATA
+	SYNC, HEADER, DATA
 } state {};
 
+Packet pkt;
+
+void send(byte type, byte seq, const byte* data, byte len)
+{
+	Serial.write(uint8_t(BYTE_SYNC));
+	Serial.write(type);
+	Serial.write(seq);
+	Serial.write(len);
+	Serial.write(data, len);
+	Serial.write(uint8_t(BYTE_END));
+}
+
+inline void reply(byte type, byte data)
+{
+	send(type, pkt.seq, &data, 1);
+}
+
+}
+
+// UltraSonic
+//############
+namespace sonar
+{
+
+using namespace proto;
+
+/**
+ * Pings waiting for one reply. Only one ping runs at a time, so the sensors
+ * don't hear each other.
+ */
+struct Job
+{
+	byte type;       // ULTRA_SONIC, ULTRA_SONIC_BURST or ULTRA_SONIC|STREAM_BIT
+	byte seq;
+	uint32_t pins;   // still to ping
+	byte k;          // pings per pin
+	byte taken;      // pings of the current pin
+	byte n;
+	byte out[MAX_DATA];
+	byte samples[MAX_SAMPLES];
+};
+
+constexpr uint8_t MAX_JOBS = 4;
+
+Job jobs[MAX_JOBS];
+uint8_t head, count;
+
+enum State : uint8_t
+{
+	IDLE, WAIT_RISE, WAIT_FALL, DONE
+};
+
+// written by the pin change interrupt
+volatile State state = IDLE;
+volatile uint32_t rise, fall;
+
+uint8_t pin;            // of the running ping
+uint32_t started;       // trigger time
+uint32_t quiet_since;   // end of the last ping, echoes die down meanwhile
+
+void pcint(uint8_t p, bool on)
+{
+	if(on)
+	{
+		PCIFR = _BV(digitalPinToPCICRbit(p)); // forget changes of the trigger pulse
+		*digitalPinToPCMSK(p) |= _BV(digitalPinToPCMSKbit(p));
+		*digitalPinToPCICR(p) |= _BV(digitalPinToPCICRbit(p));
+	}
+	else
+		*digitalPinToPCMSK(p) &= ~_BV(digitalPinToPCMSKbit(p));
+}
+
+/**
+ * Echo edge, called from the interrupt
+ */
+void edge()
+{
+	const uint32_t now = micros();
+	const bool high = digitalRead(pin);
+	if(state == WAIT_RISE && high)
+	{
+		rise = now;
+		state = WAIT_FALL;
+	}
+	else if(state == WAIT_FALL && !high)
+	{
+		fall = now;
+		state = DONE;
+		pcint(pin, false);
+	}
+}
+
+void trigger(uint8_t p)
+{
+	pin = p;
+	pinMode(pin, OUTPUT);
+	digitalWrite(pin, LOW);
+	delayMicroseconds(2);
+	digitalWrite(pin, HIGH);
+	delayMicroseconds(5);
+	digitalWrite(pin, LOW);
+
+	// the echo is timed by the interrupt, loop() goes on meanwhile
+	pinMode(pin, INPUT);
+	started = micros();
+	state = WAIT_RISE;
+	pcint(pin, true);
+}
+
+/**
+ * Distance of the finished ping, 0 without echo, 255 out of range
+ */
+uint8_t distance()
+{
+	if(state != DONE)
+		return state == WAIT_FALL ? 255 : 0;
+
+	uint32_t dur = fall - rise;
+	return dur < 1450 ? dur / 5.8 : 255;
+}
+
+/**
+ * Pass on the pings of the current pin, several as median and spread
+ */
+void reduce(Job &job)
+{
+	byte *s = job.samples;
+	if(job.k == 1)
+		job.out[job.n++] = s[0];
+	else
+	{
+		for(uint8_t i = 1; i < job.k; i++)
+		{
+			for(uint8_t j = i; j && s[j - 1] > s[j]; j--)
+			{
+				byte t = s[j];
+				s[j] = s[j - 1];
+				s[j - 1] = t;
+			}
+		}
+		job.out[job.n++] = s[(job.k - 1) / 2];
+		job.out[job.n++] = s[job.k - 1] - s[0];
+	}
+	job.taken = 0;
+}
+
+/**
+ * Queue k pings of all pins, the reply is sent after the last one
+ * @return Job to prepend data to, nullptr if the queue is full
+ */
+Job* queue(byte type, byte seq, uint32_t pins, byte k = 1)
+{
+	for(uint8_t i = 0; i < count; i++)
+	{
+		// a retransmitted request is answered once
+		Job &job = jobs[(head + i) % MAX_JOBS];
+		if(!(type & STREAM_BIT) && job.type == type && job.seq == seq)
+			return &job;
+	}
+
+	if(count == MAX_JOBS)
+		return nullptr;
+
+	Job &job = jobs[(head + count++) % MAX_JOBS];
+	job = Job{ type, seq, pins, k, 0, 0, {}, {} };
+	return &job;
+}
+
+void poll()
+{
+	if(state != IDLE)
+	{
+		if(state != DONE && micros() - started < ULTRA_SONIC_TIMEOUT_US)
+			return;
+
+		pcint(pin, false);
+		Job &job = jobs[head];
+		job.samples[job.taken++] = distance();
+		state = IDLE;
+		quiet_since = micros();
+
+		if(job.taken == job.k)
+		{
+			reduce(job);
+			job.pins &= ~(1ul << pin);
+		}
+		if(!job.pins)
+		{
+			comm::send(job.type, job.seq, job.out, job.n);
+			head = (head + 1) % MAX_JOBS;
+			count--;
+		}
+	}
+
+	if(!count || micros() - quiet_since < ULTRA_SONIC_PAUSE_US)
+		return;
+
+	// lowest pin first, it stays in pins until all its pings are done
+	Job &job = jobs[head];
+	uint8_t p = 0;
+	while(!(job.pins & (1ul << p)))
+		p++;
+	trigger(p);
+}
+
+}
+
+ISR(PCINT0_vect) { sonar::edge(); }
+ISR(PCINT1_vect) { sonar::edge(); }
+ISR(PCINT2_vect) { sonar::edge(); }
+
+// Sensor streams
+//################
+namespace stream
+{
+
+using namespace proto;
+
+struct Sub
+{
+	uint8_t kind, pin;
+	uint16_t period; // ms, 0 if unused
+	unsigned long next;
+	uint8_t seq;
+	uint8_t samples; // pings per ultra sonic reading
+} subs[MAX_STREAMS] {};
+
+byte subscribe(const byte* data, byte len)
+{
+	Type kind = Type(data[0]);
+	uint8_t pin = data[1];
+	if((kind != Type::ULTRA_SONIC && kind != Type::ANALOG) || pin >= NUM_DIGITAL_PINS)
+		return ERR_BIT | Error::INVALID_ARG;
+	if(kind == Type::ULTRA_SONIC && (SERIAL_PINS & (1ul << pin)))
+		return ERR_BIT | Error::INVALID_ARG;
+
+	uint16_t period = data[2] | (uint16_t(data[3]) << 8);
+	uint8_t samples = len >= 5 ? data[4] : 1;
+	if(!samples || samples > MAX_SAMPLES || (samples > 1 && kind != Type::ULTRA_SONIC))
+		return ERR_BIT | Error::INVALID_ARG;
+
+	Sub *slot = nullptr;
+	for(Sub &sub: subs)
+	{
+		if(sub.period && sub.kind == kind && sub.pin == pin)
+		{
+			sub.period = period; // update or end the stream
+			sub.samples = samples;
+			return 0;
+		}
+		if(!sub.period && !slot)
+			slot = &sub;
+	}
+
+	if(!period)
+		return 0;
+	if(!slot)
+		return ERR_BIT | Error::NO_SPACE;
+
+	*slot = Sub{ kind, pin, period, millis(), 0, samples };
+	return 0;
+}
+
+void poll()
+{
+	for(Sub &sub: subs)
+	{
+		if(!sub.period || long(millis() - sub.next) < 0)
+			continue;
+
+		// keep an even spacing, unless we fell behind by more than a period
+		sub.next += sub.period;
+		if(long(millis() - sub.next) >= 0)
+			sub.next = millis() + sub.period;
+
+		if(sub.kind == Type::ULTRA_SONIC)
+		{
+			// sent once the echo is back, a full queue shows up as a lost reading
+			sonar::Job *job = sonar::queue(sub.kind | STREAM_BIT, sub.seq++, 1ul << sub.pin, sub.samples);
+			if(job)
+				job->out[job->n++] = sub.pin;
+			continue;
+		}
+
+		byte data[2] = { sub.pin, analog(sub.pin) };
+		comm::send(sub.kind | STREAM_BIT, sub.seq++, data, sizeof(data));
+	}
+}
+
+}
+
+namespace comm
+{
 
 void handle()
 {
-	// [<type><param>]
+	// [<type><seq><len><data...>]
 
 	byte type, data;
 	int b;
@@ -135,38 +411,88 @@ void handle()
 				return;
 		} while(b != BYTE_SYNC);
 
+		state = State::HEADER;
+	case State::HEADER:
+		if(uint32_t(Serial.available()) < HEADER_SIZE - 1)
+			return;
+
+		pkt.type = Type(Serial.read());
+		pkt.seq = Serial.read();
+		pkt.len = Serial.read();
+		if(pkt.len > MAX_DATA)
+		{
+			state = State::SYNC;
+			return;
+		}
+
 		state = State::DATA;
 	case State::DATA:
-		if(uint32_t(Serial.available()) < PKT_SIZE - 1)
+		if(uint32_t(Serial.available()) < pkt.len + 1u)
 			return;
 
 		state = State::SYNC;
 
-		type = Serial.read();
-		data = Serial.read();
+		for(uint8_t i = 0; i < pkt.len; i++)
+			pkt.data[i] = Serial.read();
 		if(Serial.read() != BYTE_END)
 			return;
 
 		// jitter test
 //		delay(random(20, 120));
 
+		type = pkt.type;
+		data = pkt.len ? pkt.data[0] : 0;
 		switch(Type(type))
 		{
 		case Type::PING:        break;
 		case Type::VERSION:     data = FW_VERSION; break;
 		case Type::MOTOR:       motor::set_speed(data); wd.reset(); break;
-		case Type::ULTRA_SONIC: data = us_distance(data); break;
-		case Type::ANALOG:      data = map(analogRead(data), 0, 1023, 0, 255); break;
+		case Type::ANALOG:      data = analog(data); break;
+		case Type::ULTRA_SONIC:
+		case Type::ULTRA_SONIC_BURST:
+		{
+			// replied by sonar::poll() once all echoes are back
+			uint32_t pins = 0;
+			byte k = type == Type::ULTRA_SONIC && pkt.len >= 2 ? pkt.data[1] : 1;
+			if(type == Type::ULTRA_SONIC && pkt.len >= 1 && data < NUM_DIGITAL_PINS && !(SERIAL_PINS & (1ul << data)) && k && k <= MAX_SAMPLES)
+				pins = 1ul << data;
+			else if(type == Type::ULTRA_SONIC_BURST && pkt.len >= 2)
+			{
+				pins = pkt.data[0] | (uint16_t(pkt.data[1]) << 8);
+				uint8_t n = 0;
+				for(uint32_t p = pins; p; p &= p - 1)
+					n++;
+				if(n > MAX_DATA || (pins & SERIAL_PINS))
+					pins = 0;
+			}
+
+			if(!pins)
+				data = Error::INVALID_ARG;
+			else if(!sonar::queue(type, pkt.seq, pins, k))
+				data = Error::NO_SPACE;
+			else
+				return;
+			type |= ERR_BIT;
+			break;
+		}
+		case Type::SUBSCRIBE:
+			if(pkt.len < 4)
+				data = ERR_BIT | Error::INVALID_ARG;
+			else
+				data = stream::subscribe(pkt.data, pkt.len);
+			if(data & ERR_BIT)
+			{
+				type |= ERR_BIT;
+				data &= ~ERR_BIT;
+			}
+			break;
 		default:
 			type |= ERR_BIT;
 			data = Error::INVALID_ARG;
 			break;
 		}
 
-		Serial.write(uint8_t(BYTE_SYNC));
-		Serial.write(type);
-		Serial.write(data);
-		Serial.write(uint8_t(BYTE_END));
+		reply(type, data);
 		break;
 	default: break;
 	}
@@ -191,6 +517,9 @@ void loop()
 	if(Serial.available())
 		comm::handle();
 
+	stream::poll();
+	sonar::poll();
+
 	if(wd.check())
 		motor::stop();
 
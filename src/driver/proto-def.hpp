@@ -8,6 +8,12 @@ namespace proto
 
 constexpr auto BAUD = 1000000;
 
+/**
+ * Version the firmware reports, raised with every protocol change. The host
+ * refuses firmware older than the protocol it was built with.
+ */
+constexpr uint8_t FW_VERSION = 9;
+
 enum Sync : uint8_t
 {
 	BYTE_SYNC = '[',
@@ -19,28 +25,69 @@ enum Type : uint8_t
 	PING          = 0x0,
 	VERSION       = 0x1,
 	MOTOR         = 0x2,
-	ULTRA_SONIC   = 0x3,
+	ULTRA_SONIC   = 0x3, // [pin (samples)] -> distance, or [median spread] of more than one sample
 	ANALOG        = 0x4,
+	SUBSCRIBE     = 0x5, // [kind pin period_lo period_hi (samples)], period 0 ends the stream
+	ULTRA_SONIC_BURST = 0x6, // [pins_lo pins_hi] -> one distance per set pin, lowest pin first, not the serial pins 0 and 1
 
 	_MAX
 };
 
+constexpr uint8_t MAX_DATA = 8;
+/**
+ * Most pings of one ultra sonic reading. Several pings are reduced to their
+ * median and spread (max - min) by the firmware.
+ */
+constexpr uint8_t MAX_SAMPLES = 8;
+
+/**
+ * Protocol version 2:
+ *  [ type seq len data[len] ]
+ * A reply carries type and seq of its request, so the host can keep several
+ * requests in flight and match replies in any order.
+ */
 struct Packet
 {
 	Sync begin;
 	Type type;
-	uint8_t data;
-	Sync end;
+	uint8_t seq;
+	uint8_t len;
+	uint8_t data[MAX_DATA]; // only len bytes are sent, followed by BYTE_END
 };
 
-constexpr size_t PKT_SIZE = sizeof (Packet);
+constexpr size_t HEADER_SIZE = offsetof(Packet, data);
+
+constexpr size_t pkt_size(uint8_t len)
+{
+	return HEADER_SIZE + len + 1;
+}
+
+constexpr size_t PKT_MAX = pkt_size(MAX_DATA);
+
+/**
+ * Ultra sonic timing: the firmware waits at most ULTRA_SONIC_TIMEOUT_US for an
+ * echo. A burst pauses ULTRA_SONIC_PAUSE_US between two pings, so late echoes
+ * of one sensor fade out before the next one listens.
+ */
+constexpr uint16_t ULTRA_SONIC_TIMEOUT_US = 4000;
+constexpr uint16_t ULTRA_SONIC_PAUSE_US = 2000;
 
 const uint8_t ERR_BIT = (1 << 7);
 enum Error
 {
 	INVALID_ARG = 0x0,
+	NO_SPACE    = 0x1,
 };
 
+/**
+ * Readings pushed by a subscription:
+ *  [ kind|STREAM_BIT seq 2 pin value ]
+ *  [ kind|STREAM_BIT seq 3 pin median spread ] with more than one sample
+ * seq counts the samples of the stream, gaps mean lost packets.
+ */
+const uint8_t STREAM_BIT = (1 << 6);
+constexpr uint8_t MAX_STREAMS = 4;
+
 
 enum Speed : uint8_t
 {